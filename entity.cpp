@@ -25,8 +25,8 @@ const Attack& getAttack(const std::string& name) {
 const PokemonSpeciesWithAttacks& getSpecies(const std::string& name) {
   static const HashMap<std::string, PokemonSpeciesWithAttacks> result = [&]{
     std::vector<std::pair<PokemonSpeciesData, std::vector<std::string>>> species{
-      {{"Ratatta", Wide('R'), 60, 1.0 / 4}, {"Headbutt", "Tackle"}},
-      {{"Pidgey",  Wide('P'), 30, 1.0 / 3}, {"Tackle"}},
+      {{"Ratatta", Wide('R'), 60, 6,  180, 1.0 / 4}, {"Headbutt", "Tackle"}},
+      {{"Pidgey",  Wide('P'), 30, 12, 360, 1.0 / 3}, {"Tackle"}},
     };
     const auto getAttacks = [&](const std::vector<std::string>& names) {
       Attacks result = {};
@@ -49,18 +49,20 @@ const PokemonSpeciesWithAttacks& getSpecies(const std::string& name) {
 std::shared_ptr<PokemonIndividualData> getIndividual(const std::string& name) {
   const auto& [species, attacks] = getSpecies(name);
   return std::make_shared<PokemonIndividualData>(
-      PokemonIndividualData{attacks, species, std::shared_ptr<Trainer>()});
+      PokemonIndividualData{attacks, species, EntityId{}});
 }
 
 //////////////////////////////////////////////////////////////////////////////
 
-Entity::Entity(Type type_, Point pos_, Glyph glyph_, int32_t hp, double speed_)
-    : type(type_), removed(false), pos(pos_), glyph(glyph_),
-      move_timer(0), turn_timer(0), cur_hp(hp), max_hp(hp), speed(speed_) {}
+Entity::Entity(Type type_, Point pos_, Glyph glyph_, int32_t hp,
+               int32_t sight_, int32_t sight_arc_, double speed_)
+    : type(type_), pos(pos_), facing({0, 1}), glyph(glyph_),
+      cur_hp(hp), max_hp(hp),
+      sight(sight_), sight_arc(sight_arc_), speed(speed_) {}
 
 Trainer::Trainer(std::string name_, Point pos, bool player_,
-                 int32_t hp, double speed)
-    : Entity(Type::Trainer, pos, Wide('@'), hp, speed),
+                 int32_t hp, int32_t sight, double speed)
+    : Entity(Type::Trainer, pos, Wide('@'), hp, sight, 360, speed),
       name(std::move(name_)), player(player_) {}
 
 Pokemon::Pokemon(const std::string& species, Point pos)
@@ -68,7 +70,45 @@ Pokemon::Pokemon(const std::string& species, Point pos)
 
 Pokemon::Pokemon(std::shared_ptr<PokemonIndividualData> self, Point pos)
     : Entity(Type::Pokemon, pos, self->species.glyph,
-             self->species.hp, self->species.speed),
+             self->species.hp, self->species.sight,
+             self->species.sight_arc, self->species.speed),
       self(std::move(self)) {}
 
 //////////////////////////////////////////////////////////////////////////////
+
+// Generations wrap around, skipping 0, which is reserved for null handles.
+void EntityMap::remove(EntityId id) {
+  assert(find(id) != nullptr);
+  auto const index = id.index();
+  auto& slot = m_slots[index];
+  slot.value.emplace<std::monostate>();
+  slot.entity = nullptr;
+  auto const limit = uint32_t{1} << (32 - EntityId::kIndexBits);
+  if (slot.generation + 1 == limit) return;
+  slot.generation++;
+  m_free.push_back(index);
+}
+
+Entity* EntityMap::find(EntityId id) const {
+  auto const index = id.index();
+  if (!id || index >= m_slots.size()) return nullptr;
+  auto const& slot = m_slots[index];
+  return slot.generation == id.generation() ? slot.entity : nullptr;
+}
+
+EntityMap::Iterator& EntityMap::Iterator::operator++() {
+  do { slot++; } while (slot < slots->size() && !(*slots)[slot].entity);
+  return *this;
+}
+
+EntityMap::Iterator EntityMap::begin() const {
+  auto result = Iterator{&m_slots, 0};
+  if (!m_slots.empty() && !m_slots[0].entity) ++result;
+  return result;
+}
+
+EntityMap::Iterator EntityMap::end() const {
+  return Iterator{&m_slots, m_slots.size()};
+}
+
+//////////////////////////////////////////////////////////////////////////////
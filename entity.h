@@ -1,7 +1,10 @@
 #pragma once
 
 #include <array>
+#include <deque>
 #include <string>
+#include <variant>
+#include <vector>
 
 #include "base.h"
 #include "geo.h"
@@ -9,10 +12,32 @@
 //////////////////////////////////////////////////////////////////////////////
 
 struct Attack;
-struct Trainer;
 
 using Attacks = std::array<const Attack*, 4>;
 
+// A handle to an entity: the index of its slot in an EntityMap, and the
+// generation of the slot when the entity was added. Removing an entity bumps
+// its slot's generation, so handles to it go stale instead of dangling. A slot
+// whose generation would wrap is retired instead, so a stale handle can never
+// match a later entity. Generations start at 1, so the default handle is null.
+struct EntityId {
+  constexpr static uint32_t kIndexBits = 20;
+
+  uint32_t index() const { return value & ((1 << kIndexBits) - 1); }
+  uint32_t generation() const { return value >> kIndexBits; }
+  explicit operator bool() const { return value != 0; }
+
+  uint32_t value = 0;
+};
+
+inline bool operator==(EntityId a, EntityId b) { return a.value == b.value; }
+inline bool operator!=(EntityId a, EntityId b) { return !(a == b); }
+
+template <typename H>
+H AbslHashValue(H h, EntityId id) {
+  return H::combine(std::move(h), id.value);
+}
+
 struct Attack {
   std::string name;
   int32_t range;
@@ -23,13 +48,15 @@ struct PokemonSpeciesData {
   std::string name;
   Glyph glyph;
   int32_t hp;
+  int32_t sight;
+  int32_t sight_arc;
   double speed;
 };
 
 struct PokemonIndividualData {
   Attacks attacks;
   const PokemonSpeciesData& species;
-  std::weak_ptr<Trainer> trainer;
+  EntityId trainer;
 };
 
 //////////////////////////////////////////////////////////////////////////////
@@ -37,20 +64,22 @@ struct PokemonIndividualData {
 struct Entity {
   enum class Type { Pokemon, Trainer };
 
-  Entity(Type type, Point pos, Glyph glyph, int32_t hp, double speed);
+  Entity(Type type, Point pos, Glyph glyph, int32_t hp,
+         int32_t sight, int32_t sight_arc, double speed);
   virtual ~Entity() {}
 
   template <typename P, typename T> auto match(P p, T t);
   template <typename P, typename T> auto match(P p, T t) const;
 
   Type type;
-  bool removed;
+  EntityId id;
   Point pos;
+  Point facing;
   Glyph glyph;
-  int32_t move_timer;
-  int32_t turn_timer;
   int32_t cur_hp;
   int32_t max_hp;
+  int32_t sight;
+  int32_t sight_arc;
   double speed;
 
   DISALLOW_COPY_AND_ASSIGN(Entity);
@@ -64,7 +93,8 @@ struct Pokemon : public Entity {
 };
 
 struct Trainer : public Entity {
-  Trainer(std::string name, Point pos, bool player, int32_t hp, double speed);
+  Trainer(std::string name, Point pos, bool player,
+          int32_t hp, int32_t sight, double speed);
 
   std::string name;
   bool player;
@@ -88,6 +118,72 @@ auto Entity::match(P p, T t) const {
   }
 }
 
-using OwnedEntity = std::shared_ptr<Entity>;
+/////////////////////////////////////////////////////////////////////////////
+
+// Owns entities in slots that are reused as entities come and go. Slots are
+// allocated in chunks, so entities never move, and removal is O(1). Freed
+// slots are reused oldest first, so each slot's generations run out as slowly
+// as they can. Iterating yields the live entities in slot order.
+struct EntityMap {
+  EntityMap() {}
+
+  template <typename T, typename... Args>
+  T& add(Args&&... args);
+  void remove(EntityId id);
+
+  // Returns null if the handle is null or stale.
+  Entity* find(EntityId id) const;
+
+  // The entity in a slot, or null if the slot is free.
+  Entity* at(size_t slot) const { return m_slots[slot].entity; }
+  size_t slots() const { return m_slots.size(); }
+
+  struct Slot {
+    Slot() {}
+
+    uint32_t generation = 1;
+    Entity* entity = nullptr;
+    std::variant<std::monostate, Pokemon, Trainer> value;
+
+    DISALLOW_COPY_AND_ASSIGN(Slot);
+  };
+
+  struct Iterator {
+    Entity* operator*() const { return (*slots)[slot].entity; }
+    Iterator& operator++();
+    bool operator!=(const Iterator& o) const { return slot != o.slot; }
+
+    const std::deque<Slot>* slots;
+    size_t slot;
+  };
+
+  Iterator begin() const;
+  Iterator end() const;
+
+private:
+  std::deque<Slot> m_slots;
+  std::deque<uint32_t> m_free;
+
+  DISALLOW_COPY_AND_ASSIGN(EntityMap);
+};
+
+template <typename T, typename... Args>
+T& EntityMap::add(Args&&... args) {
+  auto const index = [&]{
+    if (m_free.empty()) {
+      m_slots.emplace_back();
+      return static_cast<uint32_t>(m_slots.size() - 1);
+    }
+    auto const result = m_free.front();
+    m_free.pop_front();
+    return result;
+  }();
+  assert(index < (1 << EntityId::kIndexBits));
+  auto& slot = m_slots[index];
+  auto& result = slot.value.template emplace<T>(std::forward<Args>(args)...);
+  result.id.value = (slot.generation << EntityId::kIndexBits) | index;
+  slot.entity = &result;
+  return result;
+}
 
 /////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,117 @@
+#include <stdio.h>
+
+#include <memory>
+#include <random>
+
+#include "game.h"
+
+//////////////////////////////////////////////////////////////////////////////
+
+// Checks the FOV engines against each other on random maps, at every sight
+// radius, arc and facing: the bitboard engine must match the trie engine
+// cell for cell. Shadowcasting has its own rule for which cells are in view,
+// so we only count the cells where it differs, and check that it agrees
+// with the trie about every cell on an open map, away from the walls at its
+// edges.
+
+namespace {
+
+constexpr int32_t kMapSize = 40;
+constexpr int32_t kMaxRadius = 15;
+constexpr FOVEngine kEngines[] = {
+  FOVEngine::Trie, FOVEngine::Bitboard, FOVEngine::Shadowcast};
+constexpr const char* kEngineNames[] = {"trie", "bitboard", "shadowcast"};
+
+std::unique_ptr<Board> makeBoard(FOVEngine engine, uint32_t seed, bool open) {
+  auto result = std::make_unique<Board>(Point{kMapSize, kMapSize});
+  result->setFOVEngine(engine);
+  result->clearAllTiles();
+  if (open) return result;
+
+  // Every third map is dense with walls; the others are mostly grass.
+  std::mt19937 rng(seed);
+  auto const kinds = "..\"\"\"#";
+  auto const count = seed % 3 == 0 ? 6 : 5;
+  for (auto y = 0; y < kMapSize; y++) {
+    for (auto x = 0; x < kMapSize; x++) {
+      result->setTile({x, y}, tileType(kinds[rng() % count]));
+    }
+  }
+  return result;
+}
+
+// Returns the number of cells where the engine's vision differs from the
+// trie's, for one entity with the given sight at a random free point at least
+// margin cells from the edges of the map.
+int32_t diff(Board& trie, Board& other, std::mt19937& rng, int32_t margin,
+             int32_t radius, int32_t arc, Point facing) {
+  auto const range = static_cast<uint32_t>(kMapSize - 2 * margin);
+  auto pos = Point{};
+  do {
+    pos = Point{margin + int32_t(rng() % range),
+                margin + int32_t(rng() % range)};
+  } while (trie.getStatus(pos) != Status::Free);
+
+  auto result = 0;
+  Entity* entities[2];
+  Board* boards[2] = {&trie, &other};
+  for (auto i = 0; i < 2; i++) {
+    auto& entity = boards[i]->addEntity<Pokemon>("Pidgey", pos);
+    entity.sight = radius;
+    entity.sight_arc = arc;
+    boards[i]->turnEntity(entity, facing);
+    entities[i] = &entity;
+  }
+  auto const limit = radius + 1;
+  for (auto y = -limit; y <= limit; y++) {
+    for (auto x = -limit; x <= limit; x++) {
+      auto const p = pos + Point{x, y};
+      auto const a = trie.visibilityAt(*entities[0], p);
+      auto const b = other.visibilityAt(*entities[1], p);
+      if (a != b) result++;
+    }
+  }
+  for (auto i = 0; i < 2; i++) boards[i]->removeEntity(*entities[i]);
+  return result;
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv) {
+  auto const maps = argc > 1 ? atoi(argv[1]) : 10;
+  auto failed = false;
+
+  for (auto e = 1; e < 3; e++) {
+    auto const shadowcast = kEngines[e] == FOVEngine::Shadowcast;
+    auto visions = 0;
+    auto cells = 0;
+    auto open_cells = 0;
+    for (auto m = 0; m <= maps; m++) {
+      // The last map is an open field.
+      auto const open = m == maps;
+      auto const trie = makeBoard(FOVEngine::Trie, m, open);
+      auto const other = makeBoard(kEngines[e], m, open);
+      std::mt19937 rng(m);
+      for (auto radius = 1; radius <= kMaxRadius; radius++) {
+        for (auto arc = 45; arc <= 360; arc += 45) {
+          for (auto const& facing : kSteps) {
+            auto const margin = open ? kMaxRadius + 2 : 0;
+            auto const count =
+                diff(*trie, *other, rng, margin, radius, arc, facing);
+            (open ? open_cells : cells) += count;
+            visions++;
+          }
+        }
+      }
+    }
+    auto const ok = open_cells == 0 && (shadowcast || cells == 0);
+    printf("%s: %d visions, %d cells differ from trie, %d on the open map\n",
+           kEngineNames[e], visions, cells, open_cells);
+    failed |= !ok;
+  }
+
+  printf(failed ? "FAILED\n" : "OK\n");
+  return failed ? 1 : 0;
+}
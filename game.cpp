@@ -11,36 +11,369 @@ constexpr size_t kMapSize = 31;
 constexpr size_t kFOVRadius = 15;
 constexpr size_t kVisionRadius = 3;
 
+// A vision packs each row of its window, 2 * radius + 1 cells, into 32 bits.
+static_assert(kFOVRadius <= 15);
+
 constexpr size_t kMoveTimer = 960;
 constexpr size_t kTurnTimer = 120;
+constexpr size_t kWheelRounds = 64;
+
+// Each update runs turns until the player's is up, or until this budget is
+// spent, leaving the rest of the frame for rendering. We read the clock
+// before each turn, since a turn can take far longer than the clock read.
+constexpr time_ns_t kUpdateBudget = 10000000;
+
+// We plan up to a batch of turns at once, split into tasks for the workers.
+constexpr size_t kPlanBatch = 1024;
+constexpr size_t kPlansPerTask = 64;
+
+// We refresh visions in batches of this many per thread, checking the update's
+// deadline between batches.
+constexpr size_t kRefreshesPerThread = 8;
 
 constexpr int32_t kTrainerHP = 8;
+constexpr int32_t kTrainerSight = kFOVRadius;
 constexpr double kTrainerSpeed = 1.0 / 10;
 
-constexpr Point kSteps[] = {
-  {-1,  0}, {0,  1}, { 0, -1}, {1, 0},
-  {-1, -1}, {1, -1}, {-1,  1}, {1, 1},
+//////////////////////////////////////////////////////////////////////////////
+
+// The constants in these expressions come from Point.distanceNethack.
+// They're chosen so that, in a field of tall grass, we can only see
+// cells at a distanceNethack of <= kVisionRadius away.
+constexpr int32_t kVisibilityRoot = 100 * (kVisionRadius + 1) - 95 - 46 - 25;
+
+// We repair a cached vision in place only if the repair touches at most
+// 1 / kRepairBudget of the FOV trie's nodes; otherwise, we recompute it.
+constexpr size_t kRepairBudget = 8;
+
+// Knowledge marks cells with no entity on them with this glyph.
+constexpr Glyph kNoEntity = {0, kNone, kNone};
+
+// The number of visions from points that a board caches.
+constexpr size_t kPointVisions = 64;
+
+// The board tracks entities and opaque tiles in coarse blocks of cells, each
+// 2^kBlockBits on a side. A tile change only considers the entities in the
+// blocks within kFOVRadius of the tile, and an area query only scans blocks
+// that have opaque tiles in them.
+constexpr int32_t kBlockBits = 3;
+
+Point blockOf(Point p) { return {p.x >> kBlockBits, p.y >> kBlockBits}; }
+
+int32_t visibilityLoss(bool obscure, bool diagonal) {
+  return obscure ? 95 + (diagonal ? 46 : 0) : 0;
+}
+
+int32_t visibilityStep(int32_t prev, const Tile& tile, bool diagonal) {
+  if (tile.flags & FlagBlocked) return 0;
+  auto const obscure = tile.flags & FlagObscure;
+  return std::max(prev - visibilityLoss(obscure, diagonal), 0);
+}
+
+// Every value that a cell's visibility can take, in decreasing order, and the
+// index of the value after an obscured straight or diagonal step from it. The
+// bitboard FOV engine keeps one bit plane per value, and visions store each
+// cell's index. level maps each value back to its index, or to kNoLevel for
+// values that no cell can take.
+constexpr uint8_t kNoLevel = 0xff;
+
+struct VisibilityLevels {
+  std::vector<int32_t> values;
+  std::vector<std::array<size_t, 2>> next;
+  std::vector<uint8_t> level;
 };
 
-//////////////////////////////////////////////////////////////////////////////
+const VisibilityLevels& visibilityLevels() {
+  static const VisibilityLevels result = []{
+    auto const step = [](int32_t value, bool diagonal) {
+      return std::max(value - visibilityLoss(true, diagonal), 0);
+    };
+    VisibilityLevels result{{kVisibilityRoot, 0}, {}, {}};
+    auto& values = result.values;
+    for (size_t i = 0; i < values.size(); i++) {
+      for (auto const diagonal : {false, true}) {
+        auto const next = step(values[i], diagonal);
+        auto const it = std::find(values.begin(), values.end(), next);
+        if (it == values.end()) values.push_back(next);
+      }
+    }
+    std::sort(values.rbegin(), values.rend());
+    auto const index = [&](int32_t value) -> size_t {
+      return std::find(values.begin(), values.end(), value) - values.begin();
+    };
+    for (auto const value : values) {
+      result.next.push_back({index(step(value, false)),
+                             index(step(value, true))});
+    }
+    assert(values.size() <= 16);
+    result.level.resize(kVisibilityRoot + 1, kNoLevel);
+    for (size_t i = 0; i < values.size(); i++) result.level[values[i]] = i;
+    return result;
+  }();
+  return result;
+}
+
+// The FOV trie is generated at compile time. Its bit lanes are built on first
+// use; like the trie, they're immutable and shared by every Board.
+const FOVLanes& fovLanes() {
+  static const FOVLanes result(FOVTrie<kFOVRadius>::kFOV);
+  return result;
+}
+
+const FOVCones& fovCones() {
+  static const FOVCones result(FOVTrie<kFOVRadius>::kFOV);
+  return result;
+}
+
+const FOVArcs& fovArcs() {
+  static const FOVArcs result(FOVTrie<kFOVRadius>::kFOV);
+  return result;
+}
+
+// Entities with a shorter sight radius walk the same trie, cut off at their
+// radius: a walk continues past a node only if its point is within range.
+// The trie is bounded by the same test, so at kFOVRadius, nothing changes.
+bool continuesPast(Point p, int32_t radius) {
+  return 4 * p.lenL2Squared() <= (2 * radius - 1) * (2 * radius - 1);
+}
+
+// The smallest sight radius at which a walk of the trie reaches the cell, so
+// that engines that don't walk the trie can reveal the same cells. Cells that
+// the trie never reaches need a radius past kFOVRadius.
+int32_t sightRadiusAt(Point p) {
+  static const Matrix<int32_t> result = []{
+    auto const& fov = FOVTrie<kFOVRadius>::kFOV;
+    auto const center = Point{fov.radius, fov.radius};
+    auto const side = 2 * fov.radius + 1;
+    auto result = Matrix<int32_t>({side, side}, fov.radius + 1);
+    result.set(center, 0);
+    for (size_t i = 1; i < fov.size; i++) {
+      auto const& node = fov.nodes[i];
+      auto const& prev = fov.nodes[node.parent].point;
+      auto radius = 1;
+      while (!continuesPast(prev, radius)) radius++;
+      auto const key = node.point + center;
+      result.set(key, std::min(radius, result.get(key)));
+    }
+    return result;
+  }();
+  auto const radius = static_cast<int32_t>(kFOVRadius);
+  auto const key = p + Point{radius, radius};
+  return result.contains(key) ? result.get(key) : radius + 1;
+}
+
+int32_t sightRadius(const Entity& entity) {
+  return std::clamp(entity.sight, 1, static_cast<int32_t>(kFOVRadius));
+}
+
+// Arcs are rounded down to a multiple of 45 degrees.
+int32_t sightArc(const Entity& entity) {
+  return std::clamp(entity.sight_arc / 45 * 45, 45, 360);
+}
+
+// A node's depth in the trie is its distance from the origin, so the nodes
+// that a walk with a given sight radius may visit are a prefix of the trie.
+// This function returns the length of that prefix.
+size_t sightSize(int32_t radius) {
+  static const auto result = []{
+    auto const& fov = FOVTrie<kFOVRadius>::kFOV;
+    std::vector<size_t> result(kFOVRadius + 1, 0);
+    for (size_t i = 0; i < fov.size; i++) {
+      auto const& p = fov.nodes[i].point;
+      result[std::max(std::abs(p.x), std::abs(p.y))] = i + 1;
+    }
+    for (size_t r = 1; r < result.size(); r++) {
+      result[r] = std::max(result[r], result[r - 1]);
+    }
+    return result;
+  }();
+  return result[radius];
+}
+
+// The number of words in the record of a vision's cells.
+size_t visionWords(int32_t radius) {
+  auto const side = 2 * radius + 1;
+  return side + (side * side + 7) / 8;
+}
+
+// A view of a vision's cells, with the interface of a Matrix<int32_t>.
+//
+// The levels of the cells, in row-major order, are split into two halves: the
+// byte at i holds the level of cell i in its low nibble, and that of cell
+// i + half in its high one, so that packing a matrix of levels is a loop over
+// whole bytes.
+struct VisionCells {
+  explicit VisionCells(const Vision& vision)
+      : side(2 * vision.radius + 1), half((side * side + 1) / 2),
+        rows(vision.cells),
+        levels(reinterpret_cast<uint8_t*>(vision.cells + side)),
+        table(visibilityLevels()) {}
+
+  bool contains(Point p) const {
+    return 0 <= p.x && p.x < side && 0 <= p.y && p.y < side;
+  }
+
+  int32_t get(Point p) const {
+    if (!contains(p) || !((rows[p.y] >> p.x) & 1)) return -1;
+    auto const i = p.x + side * p.y;
+    auto const high = i >= half;
+    return table.values[(levels[i - high * half] >> (4 * high)) & 0xf];
+  }
+
+  void set(Point p, int32_t value) {
+    if (!contains(p)) return;
+    auto const bit = uint32_t{1} << p.x;
+    if (value < 0) {
+      rows[p.y] &= ~bit;
+      return;
+    }
+    assert(value <= kVisibilityRoot && table.level[value] != kNoLevel);
+    assert(table.values[table.level[value]] == value);
+    rows[p.y] |= bit;
+    auto const i = p.x + side * p.y;
+    auto const high = i >= half;
+    auto const shift = 4 * high;
+    auto& byte = levels[i - high * half];
+    byte = (byte & ~(0xf << shift)) | (table.level[value] << shift);
+  }
+
+  void clear() { std::fill(rows, rows + side, 0); }
+
+  // Marks a cell as visible, leaving its level as it is.
+  void show(Point p) {
+    if (contains(p)) rows[p.y] |= uint32_t{1} << p.x;
+  }
+
+  // Copies the levels of a side x side matrix into the cells, leaving their
+  // visibility bits as they are. The loop is over whole bytes and doesn't
+  // branch on the levels, so it vectorizes.
+  void assignLevels(const Matrix<uint8_t>& values) {
+    assert((values.size() == Point{side, side}));
+    auto const data = values.data();
+    auto const out = levels;
+    auto const rest = side * side - half;
+    for (auto i = 0; i < rest; i++) {
+      out[i] = (data[i] & 0xf) | (data[i + half] << 4);
+    }
+    if (rest < half) out[rest] = data[rest] & 0xf;
+  }
+
+  int32_t side;
+  int32_t half;
+  uint32_t* rows;
+  uint8_t* levels;
+  const VisibilityLevels& table;
+};
+
+// The trie engines mark the cells that they reach in the vision as they go,
+// but compute each cell's level, not its value, into an unpacked copy of the
+// vision's window, which they pack into the vision once at the end. Levels
+// are in decreasing order of value, so a cell's level is the min over its
+// nodes, and kNoLevel, which starts out in every cell, is above them all. The
+// copy is scratch space per thread.
+Matrix<uint8_t>& scratchLevels(int32_t radius) {
+  thread_local Matrix<uint8_t> result;
+  auto const side = 2 * radius + 1;
+  if (result.size() == Point{side, side}) {
+    result.fill(kNoLevel);
+  } else {
+    result = Matrix<uint8_t>({side, side}, kNoLevel);
+  }
+  return result;
+}
+
+// The level of a node, given the level of its parent's cell.
+uint8_t levelStep(const VisibilityLevels& table, uint8_t prev,
+                  const Tile& tile, bool diagonal) {
+  if (tile.flags & FlagBlocked) return table.values.size() - 1;
+  if (!(tile.flags & FlagObscure)) return prev;
+  return table.next[prev][diagonal ? 1 : 0];
+}
+
+// A vision's visibility at a point, regardless of light.
+int32_t visibilityIn(const Vision& vision, Point point) {
+  return VisionCells(vision).get(point + vision.offset);
+}
+
+// The light at a distance from a light source.
+int32_t lightFalloff(int32_t distance, int32_t radius) {
+  return kVisibilityRoot * (radius + 1 - distance) / (radius + 1);
+}
+
+// A vision with its own cells, outside of any board's slabs.
+struct OwnedVision {
+  explicit OwnedVision(int32_t radius) : cells(visionWords(radius), 0) {
+    vision.radius = radius;
+    vision.cells = cells.data();
+  }
+
+  Vision vision;
+  std::vector<uint32_t> cells;
+};
+
+// Scratch space for visions that we don't cache, one per thread.
+Vision& scratchVision(int32_t radius) {
+  thread_local std::unique_ptr<OwnedVision> result;
+  if (!result || result->vision.radius != radius) {
+    result = std::make_unique<OwnedVision>(radius);
+  }
+  return result->vision;
+}
+
+// A Pokemon's trainer, or a null handle for trainers and wild Pokemon.
+EntityId trainerOf(const Entity& entity) {
+  return entity.match(
+    [](const Pokemon& pokemon) { return pokemon.self->trainer; },
+    [](const Trainer&) { return EntityId{}; }
+  );
+}
+
+// The index of a step in kSteps, or -1 if it isn't one of them.
+int32_t stepIndex(Point step) {
+  static const auto result = []{
+    std::array<int32_t, 9> result;
+    result.fill(-1);
+    for (size_t i = 0; i < std::size(kSteps); i++) {
+      result[3 * (kSteps[i].y + 1) + kSteps[i].x + 1] = i;
+    }
+    return result;
+  }();
+  if (std::max(std::abs(step.x), std::abs(step.y)) > 1) return -1;
+  return result[3 * (step.y + 1) + step.x + 1];
+}
 
 std::uniform_int_distribution<> die(size_t n) {
   return std::uniform_int_distribution<>{0, static_cast<int>(n - 1)};
 }
 
-void charge(Entity& entity) {
-  auto const charge = static_cast<int>(round(kTurnTimer * entity.speed));
-  if (entity.move_timer > 0) entity.move_timer -= charge;
-  if (entity.turn_timer > 0) entity.turn_timer -= charge;
+// The number of rounds that a timer takes to run down, at one charge each.
+int32_t charges(int32_t timer, int32_t charge) {
+  return timer > 0 ? (timer + charge - 1) / charge : 0;
 }
 
-//bool moveReady(const Entity& entity) { return entity.move_timer <= 0; }
+//bool moveReady(const EntityTable& table, size_t row) {
+//  return table.move_timers[row] <= 0;
+//}
 
-bool turnReady(const Entity& entity) { return entity.turn_timer <= 0; }
+void wait(Board& board, Entity& entity, double moves, double turns) {
+  board.delayEntity(entity, static_cast<int>(round(kMoveTimer * moves)),
+                    static_cast<int>(round(kTurnTimer * turns)));
+}
 
-void wait(Entity& entity, double moves, double turns) {
-  entity.move_timer += static_cast<int>(round(kMoveTimer * moves));
-  entity.turn_timer += static_cast<int>(round(kTurnTimer * turns));
+// The index of a point along a Hilbert curve over a square with sides of
+// 2^bits cells.
+uint64_t hilbertIndex(Point p, int32_t bits) {
+  auto const n = int32_t{1} << bits;
+  auto result = uint64_t{0};
+  for (auto s = n / 2; s > 0; s /= 2) {
+    auto const rx = (p.x & s) ? 1 : 0;
+    auto const ry = (p.y & s) ? 1 : 0;
+    result += uint64_t(s) * s * ((3 * rx) ^ ry);
+    if (ry) continue;
+    if (rx) p = Point{n - 1 - p.x, n - 1 - p.y};
+    std::swap(p.x, p.y);
+  }
+  return result;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -59,7 +392,12 @@ bool player(const Entity& entity) {
   );
 }
 
-Action plan(const Entity& entity, MaybeAction& input, RNG& rng) {
+// planTurns calls this on many entities at once, from the workers, so it may
+// only use Board calls that are safe to run concurrently: those that read the
+// board, like getTile, getStatus, canSee and visibilityAt. It must not call
+// getVision, getVisionAt or getTeamVision, which fill the board's caches, nor
+// any call that changes the board. Lights are brought up to date beforehand.
+Action plan(const Entity& entity, MaybeAction& input, EntityRNG& rng) {
   if (!player(entity)) {
     return MoveAction{kSteps[die(std::size(kSteps))(rng)]};
   }
@@ -76,7 +414,11 @@ Result act(Board& board, Entity& entity, const Action& action) {
     [&](const MoveAction& m) {
       auto const pos = entity.pos + m.step;
       if (pos == entity.pos) return kSuccess;
-      if (board.getStatus(pos) != Status::Free) return kFailure;
+      board.turnEntity(entity, m.step);
+      auto const i = stepIndex(m.step);
+      auto const free = i >= 0 ? (board.getFreeSteps(entity.pos) >> i) & 1
+                               : board.getStatus(pos) == Status::Free;
+      if (!free) return kFailure;
       board.moveEntity(entity, pos);
       return kSuccess;
     },
@@ -86,6 +428,107 @@ Result act(Board& board, Entity& entity, const Action& action) {
 
 //////////////////////////////////////////////////////////////////////////////
 
+// Advances every lane of the trie by one depth at a time. For each level, we
+// track the lanes whose node has that visibility and the lanes whose cell
+// does: a cell's visibility is the max over its lanes, and each node's is
+// computed from its parent cell's. N is the number of words per lane mask.
+//
+// Lanes stop at cells out of the vision's radius, like the trie walk does.
+//
+// The cells at a depth lie on the rows that earlier depths read and on the two
+// rows at that depth, so we read those two rows whole, a word per row from
+// each tile matrix, and test each cell's tiles in the words.
+template <size_t N>
+void bitboardFOV(const FOVLanes& lanes, const BitMatrix& blocked_tiles,
+                 const BitMatrix& obscure_tiles, Point pos, Vision& vision) {
+  using Mask = std::array<uint64_t, N>;
+  auto const& levels = visibilityLevels();
+  auto const count = levels.values.size();
+  auto const zero = count - 1;
+  auto const center = pos + vision.offset;
+  auto const radius = vision.radius;
+  auto map = VisionCells(vision);
+
+  auto const intersects = [](const uint64_t* a, const Mask& b) {
+    auto result = uint64_t{0};
+    for (size_t j = 0; j < N; j++) result |= a[j] & b[j];
+    return result != 0;
+  };
+
+  auto const reach = static_cast<int32_t>(lanes.depths.size()) - 1;
+  auto const side = 2 * reach + 1;
+  constexpr int32_t kMaxSide = 64;
+  assert(side <= kMaxSide);
+  uint64_t blocked_rows[kMaxSide], obscure_rows[kMaxSide];
+  auto const readRows = [&](int32_t y) {
+    auto const start = Point{pos.x - reach, pos.y + y};
+    blocked_rows[reach + y] = blocked_tiles.getRow(start, side);
+    obscure_rows[reach + y] = obscure_tiles.getRow(start, side);
+  };
+  readRows(0);
+
+  constexpr size_t kMaxLevels = 16;
+  assert(count <= kMaxLevels);
+  Mask own[kMaxLevels] = {};
+  Mask cell[kMaxLevels] = {};
+  Mask open = {};
+  auto const root = lanes.mask(lanes.depths[0].live);
+  std::copy(root, root + N, open.begin());
+  cell[0] = open;
+  map.set(center, levels.values[0]);
+
+  for (size_t d = 1; d < lanes.depths.size(); d++) {
+    auto const& depth = lanes.depths[d];
+    auto const diagonal = lanes.mask(depth.diagonal);
+    auto const live = lanes.mask(depth.live);
+    if (!intersects(live, open)) break;
+    readRows(-static_cast<int32_t>(d));
+    readRows(static_cast<int32_t>(d));
+
+    Mask seen, blocked = {}, obscure = {};
+    for (size_t j = 0; j < N; j++) seen[j] = open[j] & live[j];
+    for (auto i = depth.cells_start; i < depth.cells_limit; i++) {
+      auto const rays = lanes.mask(lanes.cells[i].mask);
+      if (!intersects(rays, seen)) continue;
+      auto const q = lanes.cells[i].point + Point{reach, reach};
+      auto const bit = uint64_t{1} << q.x;
+      auto const target = blocked_rows[q.y] & bit ? &blocked
+                        : obscure_rows[q.y] & bit ? &obscure : nullptr;
+      if (target) for (size_t j = 0; j < N; j++) (*target)[j] |= rays[j];
+    }
+
+    for (size_t l = 0; l < count; l++) own[l] = {};
+    for (size_t l = 0; l < zero; l++) {
+      auto const& next = levels.next[l];
+      for (size_t j = 0; j < N; j++) {
+        auto const from = cell[l][j] & seen[j] & ~blocked[j];
+        own[l][j] |= from & ~obscure[j];
+        own[next[0]][j] |= from & obscure[j] & ~diagonal[j];
+        own[next[1]][j] |= from & obscure[j] & diagonal[j];
+      }
+    }
+    for (size_t j = 0; j < N; j++) own[zero][j] |= seen[j] & blocked[j];
+
+    Mask cut = {};
+    for (size_t l = 0; l < count; l++) cell[l] = {};
+    for (auto i = depth.cells_start; i < depth.cells_limit; i++) {
+      auto const rays = lanes.mask(lanes.cells[i].mask);
+      if (!intersects(rays, seen)) continue;
+      auto level = size_t{0};
+      while (!intersects(rays, own[level])) level++;
+      auto const point = lanes.cells[i].point;
+      map.set(center + point, levels.values[level]);
+      for (size_t j = 0; j < N; j++) cell[level][j] |= rays[j];
+      if (continuesPast(point, radius)) continue;
+      for (size_t j = 0; j < N; j++) cut[j] |= rays[j];
+    }
+
+    for (size_t j = 0; j < N; j++) open[j] = seen[j] & ~own[zero][j] & ~cut[j];
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
 void initBoard(Board& board, RNG& rng) {
   board.clearAllTiles();
   auto const size = board.getSize();
@@ -159,143 +602,1364 @@ void initBoard(Board& board, RNG& rng) {
 
 //////////////////////////////////////////////////////////////////////////////
 
-Board::Board(Point size) : m_fov(kFOVRadius), m_map(size, tileType('#')) {}
+uint32_t* VisionSlab::allocate() {
+  constexpr size_t kChunk = 64;
+  if (m_free.empty()) {
+    m_chunks.emplace_back(new uint32_t[kChunk * m_words]());
+    auto const chunk = m_chunks.back().get();
+    for (size_t i = kChunk; i-- > 0;) m_free.push_back(chunk + i * m_words);
+  }
+  auto const result = m_free.back();
+  m_free.pop_back();
+  return result;
+}
+
+void VisionSlab::release(uint32_t* record) { m_free.push_back(record); }
+
+//////////////////////////////////////////////////////////////////////////////
+
+TeamVision::TeamVision(Point size) : visibility(size, -1) {}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Knowledge::Knowledge(Point size_)
+    : size(size_), seen(size.x * size.y, 0),
+      tiles(size.x * size.y, nullptr), entities(size.x * size.y, kNoEntity) {}
+
+bool Knowledge::sees(Point p) const {
+  auto const inside = 0 <= p.x && p.x < size.x && 0 <= p.y && p.y < size.y;
+  return inside && stamp > 0 && seen[p.x + size.x * p.y] == stamp;
+}
+
+const Tile* Knowledge::getTile(Point p) const {
+  auto const inside = 0 <= p.x && p.x < size.x && 0 <= p.y && p.y < size.y;
+  return inside ? tiles[p.x + size.x * p.y] : nullptr;
+}
+
+std::optional<Glyph> Knowledge::getEntity(Point p) const {
+  if (!getTile(p)) return std::nullopt;
+  auto const glyph = entities[p.x + size.x * p.y];
+  if (glyph == kNoEntity) return std::nullopt;
+  return glyph;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+Board::Board(Point size)
+    : m_fov(FOVTrie<kFOVRadius>::kFOV), m_map(size, tileType('#')),
+      m_blocked(size, true), m_obscure(size, false),
+      m_entityAt(size, EntityId{}), m_freeSteps(size, 0),
+      m_ambientLight(kVisibilityRoot), m_light(size, 0) {
+  countOpaqueTiles();
+  countFreeSteps();
+  m_wheel.resize(kWheelRounds);
+  for (auto r = 0; r <= m_fov.radius; r++) {
+    m_visionSlabs.emplace_back(visionWords(r));
+  }
+}
 
 Point Board::getSize() const { return m_map.size(); }
 
 Status Board::getStatus(Point p) const {
-  if (getTile(p).flags & FlagBlocked) return Status::Blocked;
-  if (m_entityAtPos.contains(p)) return Status::Occupied;
+  if (m_blocked.get(p)) return Status::Blocked;
+  if (m_entityAt.get(p)) return Status::Occupied;
   return Status::Free;
 }
 
+uint8_t Board::getFreeSteps(Point p) const { return m_freeSteps.get(p); }
+
 const Tile& Board::getTile(Point p) const { return *m_map.get(p); }
 
-Entity& Board::getActiveEntity() {
-  assert(m_entityIndex < m_entities.size());
-  return *m_entities[m_entityIndex];
+// Blocks inside the map with no opaque tiles are skipped, and blocks that we
+// cover entirely are decided by their counts. We scan the rest a row at a time.
+bool Board::isOpenArea(Point lo, Point hi) const {
+  auto const size = getSize();
+  auto const block = 1 << kBlockBits;
+  auto const a = blockOf(lo), b = blockOf(hi);
+  for (auto y = a.y; y <= b.y; y++) {
+    for (auto x = a.x; x <= b.x; x++) {
+      auto const base = Point{x << kBlockBits, y << kBlockBits};
+      auto const start = Point{std::max(lo.x, base.x), std::max(lo.y, base.y)};
+      auto const limit = Point{std::min(hi.x, base.x + block - 1),
+                               std::min(hi.y, base.y + block - 1)};
+      auto const inside = start.x >= 0 && start.y >= 0 &&
+                          limit.x < size.x && limit.y < size.y;
+      auto const count = m_opaqueByBlock.get({x, y});
+      if (inside && count == 0) continue;
+      auto const whole = start == base &&
+                         limit == base + Point{block - 1, block - 1};
+      if (inside && whole) return false;
+
+      auto const n = limit.x - start.x + 1;
+      for (auto row = start.y; row <= limit.y; row++) {
+        auto const p = Point{start.x, row};
+        if (m_blocked.getRow(p, n) | m_obscure.getRow(p, n)) return false;
+      }
+    }
+  }
+  return true;
 }
 
 Entity* Board::getEntity(Point p) {
-  auto const it = m_entityAtPos.find(p);
-  return it != m_entityAtPos.end() ? it->second.get() : nullptr;
+  return m_entities.find(m_entityAt.get(p));
 }
 
-const std::vector<Entity*>& Board::getEntities() const { return m_entities; }
+Entity* Board::getEntity(EntityId id) const { return m_entities.find(id); }
+
+const EntityMap& Board::getEntities() const { return m_entities; }
 
-void Board::clearAllTiles() { m_map.fill(tileType('.')); }
+const EntityTable& Board::getEntityTable() const { return m_table; }
+
+void Board::clearAllTiles() {
+  auto const tile = tileType('.');
+  m_map.fill(tile);
+  m_blocked.fill(tile->flags & FlagBlocked);
+  m_obscure.fill(tile->flags & FlagObscure);
+  countOpaqueTiles();
+  countFreeSteps();
+  for (auto const vision : m_vision) {
+    if (vision) dirtyVision(*vision, nullptr);
+  }
+  for (auto& [_, vision] : m_pointVisions) dirtyVision(*vision, nullptr);
+  for (size_t i = 0; i < m_lights.size(); i++) dirtyLight(i);
+}
 
 void Board::setTile(Point p, const Tile* tile) {
   if (!m_map.contains(p)) return;
   auto const prev = m_map.get(p);
   m_map.set(p, tile);
+  m_blocked.set(p, tile->flags & FlagBlocked);
+  m_obscure.set(p, tile->flags & FlagObscure);
+
+  if ((prev->flags ^ tile->flags) & FlagBlocked) updateFreeSteps(p);
 
   auto const mask = (FlagBlocked | FlagObscure);
+  auto const opaque = [&](const Tile* t) { return (t->flags & mask) ? 1 : 0; };
+  auto const delta = opaque(tile) - opaque(prev);
+  if (delta) {
+    auto const block = blockOf(p);
+    m_opaqueByBlock.set(block, m_opaqueByBlock.get(block) + delta);
+  }
+
   auto const dirty = (prev->flags & mask) != (tile->flags & mask);
-  if (dirty) for (auto const& entity : m_entities) dirtyVision(*entity, &p);
+  if (!dirty) return;
+  forEachEntityInRange(p, [&](Entity& entity) {
+    auto const vision = findVision(entity);
+    if (vision) dirtyVision(*vision, &p);
+  });
+  for (auto const& [pos, vision] : m_pointVisions) {
+    auto const d = pos - p;
+    auto const distance = std::max(std::abs(d.x), std::abs(d.y));
+    if (distance <= vision->radius) dirtyVision(*vision, &p);
+  }
+
+  // Like visions, a light's can only change if it saw the tile.
+  auto const shadowcast = m_fovEngine == FOVEngine::Shadowcast;
+  for (size_t i = 0; i < m_lights.size(); i++) {
+    auto const& light = m_lights[i];
+    if (!light.vision || light.vision->dirty) continue;
+    auto const d = light.pos - p;
+    auto const distance = std::max(std::abs(d.x), std::abs(d.y));
+    if (distance > light.vision->radius) continue;
+    if (shadowcast || visibilityIn(*light.vision, p) >= 0) dirtyLight(i);
+  }
 }
 
-void Board::addEntity(OwnedEntity entity) {
-  m_entities.emplace_back(entity.get());
-  auto& entry = m_entityAtPos[entity->pos];
-  assert(entry == nullptr);
-  entry = std::move(entity);
+// Called by addEntity once the entity is in its slot. Its row goes at the end
+// of the table, so it takes its first turn at the end of this round.
+void Board::placeEntity(Entity& entity) {
+  auto const pos = entity.pos;
+  assert(m_entityAt.contains(pos));
+  assert(!m_entityAt.get(pos));
+  m_entityAt.set(pos, entity.id);
+
+  auto& table = m_table;
+  m_rows.resize(m_entities.slots(), -1);
+  m_rows[entity.id.index()] = table.size();
+  table.entities.push_back(&entity);
+  table.pos.push_back(pos);
+  table.glyphs.push_back(entity.glyph);
+  table.move_timers.push_back(0);
+  table.turn_timers.push_back(0);
+  table.charges.push_back(static_cast<int>(round(kTurnTimer * entity.speed)));
+  assert(table.charges.back() > 0);
+  m_tableChanges++;
+  m_turns.push_back(table.size() - 1);
+
+  updateFreeSteps(pos);
+  indexEntity(entity, true);
+  auto const team = m_teams.find(trainerOf(entity));
+  if (team != m_teams.end()) joinTeam(*team->second, entity);
 }
 
 void Board::moveEntity(Entity& entity, Point to) {
-  auto it = m_entityAtPos.find(entity.pos);
-  assert(it != m_entityAtPos.end());
-  assert(it->second.get() == &entity);
-  OwnedEntity source = std::move(it->second);
-  m_entityAtPos.erase(it);
+  auto const from = entity.pos;
+  assert(m_entityAt.get(from) == entity.id);
+  assert(m_entityAt.contains(to));
+  assert(!m_entityAt.get(to));
+  auto const reindex = blockOf(from) != blockOf(to);
+  if (reindex) indexEntity(entity, false);
+  m_entityAt.set(from, EntityId{});
+  m_entityAt.set(to, entity.id);
+  m_table.pos[m_rows[entity.id.index()]] = to;
+  m_tableChanges++;
+  entity.pos = to;
+  updateFreeSteps(from);
+  updateFreeSteps(to);
+  if (reindex) indexEntity(entity, true);
+  moveVision(entity, from);
+}
 
-  OwnedEntity& target = m_entityAtPos[to];
-  assert(target == nullptr);
-  target = std::move(source);
-  target->pos = to;
-  dirtyVision(entity, nullptr);
+void Board::turnEntity(Entity& entity, Point facing) {
+  if (facing == entity.facing) return;
+  entity.facing = facing;
+  auto const vision = findVision(entity);
+  if (!vision) return;
+  vision->facing = facing;
+  if (vision->arc < 360) vision->dirty = true;
 }
 
 void Board::removeEntity(Entity& entity) {
-  auto it = m_entityAtPos.find(entity.pos);
-  assert(it != m_entityAtPos.end());
-  assert(it->second.get() == &entity);
-  m_entityAtPos.erase(it);
-  m_vision.erase(&entity);
+  assert(m_entities.find(entity.id) == &entity);
+  assert(m_entityAt.get(entity.pos) == entity.id);
+  m_entityAt.set(entity.pos, EntityId{});
+  auto& row = m_rows[entity.id.index()];
+  m_table.entities[row] = nullptr;
+  row = -1;
+  m_tableChanges++;
+  updateFreeSteps(entity.pos);
+  indexEntity(entity, false);
+  leaveTeam(entity);
+  auto const vision = findVision(entity);
+  if (vision) {
+    releaseVision(vision);
+    m_vision[entity.id.index()] = nullptr;
+  }
+  m_entities.remove(entity.id);
+}
+
+Entity& Board::getReadyEntity() { return *m_table.entities[activeRow()]; }
+
+void Board::delayEntity(Entity& entity, int32_t moves, int32_t turns) {
+  auto const row = m_rows[entity.id.index()];
+  assert(m_turnIndex < m_turns.size() && m_turns[m_turnIndex] == row);
+  auto& table = m_table;
+  auto const charge = table.charges[row];
+  auto& move = table.move_timers[row];
+  auto& turn = table.turn_timers[row];
+  move += moves;
+  turn += turns;
+  auto const rounds = charges(turn, charge);
+  if (rounds == 0) return;
+  move -= std::min(rounds, charges(move, charge)) * charge;
+  turn -= rounds * charge;
+  scheduleTurn(row, m_round + rounds);
+  m_turnIndex++;
+}
+
+size_t Board::getPendingTurns() const {
+  auto result = size_t{0};
+  for (auto i = m_turnIndex; i < m_turns.size(); i++) {
+    if (m_table.entities[m_turns[i]]) result++;
+  }
+  return result;
+}
+
+std::vector<Entity*> Board::getPendingEntities(size_t limit) const {
+  std::vector<Entity*> result;
+  for (auto i = m_turnIndex; i < m_turns.size(); i++) {
+    if (result.size() == limit) break;
+    auto const entity = m_table.entities[m_turns[i]];
+    if (entity) result.push_back(entity);
+  }
+  return result;
+}
+
+// Returns the row of the next entity to act.
+size_t Board::activeRow() {
+  do {
+    for (; m_turnIndex < m_turns.size(); m_turnIndex++) {
+      auto const row = m_turns[m_turnIndex];
+      if (m_table.entities[row]) return row;
+    }
+  } while (startRound());
+  assert(false);
+  return 0;
+}
+
+// Skips to the next round with any turns in it. When we start a round, we
+// sort the table if enough has changed since we last did, which on average
+// is once every entity has moved.
+bool Board::startRound() {
+  auto const wheel = m_wheel.size();
+  auto round = m_round + 1;
+  while (round < m_round + wheel && m_wheel[round % wheel].empty()) round++;
+  if (round == m_round + wheel) {
+    if (m_laterTurns.empty()) return false;
+    round = m_laterTurns[0].first;
+  }
+  m_round = round;
+  if (m_tableChanges >= m_table.size()) sortEntityTable();
+
+  auto const later = std::greater<>();
+  while (!m_laterTurns.empty() && m_laterTurns[0].first < round + wheel) {
+    auto const [when, row] = m_laterTurns[0];
+    m_wheel[when % wheel].push_back(row);
+    std::pop_heap(m_laterTurns.begin(), m_laterTurns.end(), later);
+    m_laterTurns.pop_back();
+  }
+  // Put this round's rows in order. A row is scheduled at most once, so we
+  // can mark them in a bitset and read them back, which beats sorting.
+  thread_local std::vector<uint64_t> marked;
+  marked.assign((m_table.size() + 63) / 64, 0);
+  auto& turns = m_wheel[round % wheel];
+  for (auto const row : turns) marked[row / 64] |= uint64_t{1} << (row % 64);
+  turns.clear();
+  m_turns.clear();
+  m_turnIndex = 0;
+  for (size_t i = 0; i < marked.size(); i++) {
+    for (auto bits = marked[i]; bits; bits &= bits - 1) {
+      m_turns.push_back(64 * i + __builtin_ctzll(bits));
+    }
+  }
+  return true;
 }
 
-void Board::advanceEntity() {
-  charge(getActiveEntity());
-  m_entityIndex += 1;
-  if (m_entityIndex >= m_entities.size()) m_entityIndex = 0;
+void Board::scheduleTurn(uint32_t row, uint64_t round) {
+  assert(round > m_round);
+  if (round < m_round + m_wheel.size()) {
+    m_wheel[round % m_wheel.size()].push_back(row);
+    return;
+  }
+  m_laterTurns.push_back({round, row});
+  std::push_heap(m_laterTurns.begin(), m_laterTurns.end(), std::greater<>());
+}
+
+// Orders the rows along a Hilbert curve and drops the rows of removed
+// entities. Only called between rounds, so it never reorders a round, but
+// the scheduled turns must move with their rows.
+void Board::sortEntityTable() {
+  auto& table = m_table;
+  auto const size = getSize();
+  auto bits = 0;
+  while ((1 << bits) < std::max(size.x, size.y)) bits++;
+
+  std::vector<std::pair<uint64_t, uint32_t>> keys;
+  for (size_t i = 0; i < table.size(); i++) {
+    if (!table.entities[i]) continue;
+    keys.push_back({hilbertIndex(table.pos[i], bits), i});
+  }
+  std::sort(keys.begin(), keys.end());
+  auto const rows = table.size();
+
+  auto const permute = [&](auto& column) {
+    std::remove_reference_t<decltype(column)> result;
+    result.reserve(keys.size());
+    for (auto const& [_, i] : keys) result.push_back(column[i]);
+    column = std::move(result);
+  };
+  permute(table.entities);
+  permute(table.pos);
+  permute(table.glyphs);
+  permute(table.move_timers);
+  permute(table.turn_timers);
+  permute(table.charges);
+  for (size_t i = 0; i < table.size(); i++) {
+    m_rows[table.entities[i]->id.index()] = i;
+  }
+  m_tableChanges = 0;
+
+  auto const kDead = ~uint32_t{0};
+  std::vector<uint32_t> moved(rows, kDead);
+  for (size_t i = 0; i < keys.size(); i++) moved[keys[i].second] = i;
+  auto const dead = [&](uint32_t row) { return moved[row] == kDead; };
+  for (auto& turns : m_wheel) {
+    turns.erase(std::remove_if(turns.begin(), turns.end(), dead), turns.end());
+    for (auto& row : turns) row = moved[row];
+  }
+  auto& later = m_laterTurns;
+  auto const dead_later = [&](auto const& turn) { return dead(turn.second); };
+  later.erase(std::remove_if(later.begin(), later.end(), dead_later),
+              later.end());
+  for (auto& [_, row] : later) row = moved[row];
+  std::make_heap(later.begin(), later.end(), std::greater<>());
+}
+
+void Board::setFOVEngine(FOVEngine engine) {
+  if (m_fovEngine == engine) return;
+  m_fovEngine = engine;
+  for (auto const vision : m_vision) {
+    if (vision) vision->dirty = true;
+  }
+  for (auto& [_, vision] : m_pointVisions) vision->dirty = true;
+  for (size_t i = 0; i < m_lights.size(); i++) dirtyLight(i);
 }
 
 bool Board::canSee(const Entity& entity, Point point) const {
-  return canSee(getVision(entity), point);
+  return visibilityAt(entity, point) >= 0;
 }
 
 bool Board::canSee(const Vision& vision, Point point) const {
   return visibilityAt(vision, point) >= 0;
 }
 
+bool Board::canSee(const TeamVision& team, Point point) const {
+  return visibilityAt(team, point) >= 0;
+}
+
+// Queries from an entity only use its vision if it's already up to date.
 int32_t Board::visibilityAt(const Entity& entity, Point point) const {
-  return visibilityAt(getVision(entity), point);
+  auto const vision = findVision(entity);
+  if (vision && !vision->dirty) return visibilityAt(*vision, point);
+  if (!inArc(point - entity.pos, entity.facing, sightArc(entity))) return -1;
+  return visibilityBetween(entity.pos, point, sightRadius(entity));
 }
 
 int32_t Board::visibilityAt(const Vision& vision, Point point) const {
-  return vision.visibility.get(point + vision.offset);
+  return lit(point, visibilityIn(vision, point));
+}
+
+int32_t Board::visibilityAt(const TeamVision& team, Point point) const {
+  return lit(point, team.visibility.get(point));
+}
+
+int32_t Board::visibilityBetween(Point from, Point to, int32_t radius) const {
+  return lit(to, unlitVisibilityBetween(from, to, radius));
+}
+
+// With the trie engines, we evaluate just the nodes of the target's cone, in
+// BFS order. Shadowcasting has nothing like a cone, so we cast in full.
+int32_t Board::unlitVisibilityBetween(
+    Point from, Point to, int32_t radius) const {
+  radius = std::clamp(radius, 1, m_fov.radius);
+  auto const d = to - from;
+  if (std::max(std::abs(d.x), std::abs(d.y)) > radius) return -1;
+
+  if (m_fovEngine == FOVEngine::Shadowcast) {
+    auto& vision = scratchVision(radius);
+    computeVision(from, vision);
+    return visibilityIn(vision, to);
+  }
+
+  auto const cone = fovCones().cone(d);
+  if (cone.size == 0) return -1;
+
+  constexpr int32_t kMaxCells = 256;
+  assert(fovCones().max_cells <= kMaxCells);
+  int32_t cells[kMaxCells];
+  std::fill(cells, cells + cone.cells, -1);
+
+  thread_local std::vector<int32_t> values;
+  values.resize(std::max(values.size(), static_cast<size_t>(cone.size)));
+
+  for (auto i = 0; i < cone.size; i++) {
+    auto const& node = cone.nodes[i];
+    auto const value = [&]() -> int32_t {
+      if (node.parent < 0) return kVisibilityRoot;
+      if (values[node.parent] <= 0) return -1;
+      auto const& prev = cone.nodes[node.parent].point;
+      if (!continuesPast(prev, radius)) return -1;
+      auto const& tile = *m_map.get(node.point + from);
+      return visibilityStep(cells[node.parent_cell], tile, node.diagonal);
+    }();
+    values[i] = value;
+    cells[node.cell] = std::max(cells[node.cell], value);
+  }
+  return cells[0];
+}
+
+// Pairs with the same source can share a full cast, so we sort the pairs by
+// source. We cast once for each source whose targets' cones, together, have
+// more nodes than the trie, and we evaluate each cone otherwise.
+std::vector<int32_t> Board::visibilityBetween(
+    const std::vector<std::pair<Point, Point>>& pairs, int32_t radius) const {
+  radius = std::clamp(radius, 1, m_fov.radius);
+  std::vector<int32_t> result(pairs.size(), -1);
+
+  // A counting sort on the source, with groups in order of first appearance.
+  HashMap<Point, int32_t> groups;
+  std::vector<int32_t> starts;
+  groups.reserve(pairs.size());
+  for (auto const& [from, _] : pairs) {
+    auto const [it, inserted] = groups.insert({from, starts.size()});
+    if (inserted) starts.push_back(0);
+    starts[it->second]++;
+  }
+  auto offset = 0;
+  for (auto& start : starts) {
+    auto const count = start;
+    start = offset;
+    offset += count;
+  }
+  std::vector<int32_t> order(pairs.size());
+  for (size_t i = 0; i < pairs.size(); i++) {
+    order[starts[groups.find(pairs[i].first)->second]++] = i;
+  }
+
+  auto const shadowcast = m_fovEngine == FOVEngine::Shadowcast;
+  auto const& cones = fovCones();
+  auto& vision = scratchVision(radius);
+
+  for (size_t i = 0; i < order.size();) {
+    auto const from = pairs[order[i]].first;
+    auto end = i + 1;
+    while (end < order.size() && pairs[order[end]].first == from) end++;
+
+    size_t cost = 0;
+    for (auto j = i; j < end && !shadowcast && end - i > 1; j++) {
+      cost += cones.cone(pairs[order[j]].second - from).size;
+    }
+
+    if (shadowcast || cost > sightSize(radius)) {
+      computeVision(from, vision);
+      for (; i < end; i++) {
+        auto const to = pairs[order[i]].second;
+        result[order[i]] = lit(to, visibilityIn(vision, to));
+      }
+    } else {
+      for (; i < end; i++) {
+        auto const to = pairs[order[i]].second;
+        result[order[i]] = visibilityBetween(from, to, radius);
+      }
+    }
+  }
+  return result;
 }
 
 const Vision& Board::getVision(const Entity& entity) const {
-  auto const radius = kFOVRadius;
-  auto& result = m_vision[&entity];
-  if (result == nullptr) {
-    result.reset(new Vision{});
-    const size_t side = 2 * radius + 1;
-    result->visibility = Matrix({side, side}, -1);
-  }
-
-  if (result->dirty) {
-    auto const pos = entity.pos;
-    auto const offset = Point{radius, radius} - pos;
-    auto& map = result->visibility;
-    map.fill(-1);
-
-    auto const blocked = [&](Point p, const Point* parent) {
-      auto const q = p + pos;
-      auto const visibility = [&]() -> int32_t {
-        // The constants in these expressions come from Point.distanceNethack.
-        // They're chosen so that, in a field of tall grass, we can only see
-        // cells at a distanceNethack of <= kVisionRadius away.
-        if (!parent) return 100 * (kVisionRadius + 1) - 95 - 46 - 25;
-
-        auto const tile = m_map.get(q);
-        if (tile->flags & FlagBlocked) return 0;
-
-        auto const obscure = tile->flags & FlagObscure;
-        auto const diagonal = p.x != parent->x && p.y != parent->y;
-        auto const loss = obscure ? 95 + (diagonal ? 46 : 0) : 0;
-        auto const prev = map.get(*parent + pos + offset);
-        return std::max(prev - loss, 0);
-      }();
-
-      auto const key = q + offset;
-      map.set(key, std::max(visibility, map.get(key)));
-      return visibility <= 0;
-    };
+  auto& result = allocateVision(entity);
+  if (result.dirty) computeVision(entity.pos, result);
+  return result;
+}
+
+// On a miss with a full cache, we evict the least recently used vision.
+const Vision& Board::getVisionAt(Point p, int32_t radius) const {
+  radius = std::clamp(radius, 1, m_fov.radius);
+  auto const key = std::make_pair(p, radius);
+  auto const it = m_pointVisionIndex.find(key);
+  if (it != m_pointVisionIndex.end()) {
+    m_pointVisions.splice(m_pointVisions.begin(), m_pointVisions, it->second);
+  } else {
+    if (m_pointVisions.size() < kPointVisions) {
+      m_pointVisions.emplace_front(p, nullptr);
+    } else {
+      m_pointVisions.splice(m_pointVisions.begin(), m_pointVisions,
+                            std::prev(m_pointVisions.end()));
+      auto const& [pos, vision] = m_pointVisions.front();
+      m_pointVisionIndex.erase(std::make_pair(pos, vision->radius));
+      releaseVision(vision);
+    }
+    auto& [pos, vision] = m_pointVisions.front();
+    pos = p;
+    vision = takeVision(radius);
+    m_pointVisionIndex[key] = m_pointVisions.begin();
+  }
+  auto& result = *m_pointVisions.front().second;
+  if (result.dirty) computeVision(p, result);
+  return result;
+}
+
+// A member's vision gets a new version whenever it changes, so we only merge
+// the members whose version differs from the one we merged. Then we redo the
+// cells in each window that changed, taking the max over the members that see
+// each cell. The other members' visions are unchanged, so their values hold.
+const TeamVision& Board::getTeamVision(const Entity& trainer) const {
+  auto& team = m_teams[trainer.id];
+  if (!team) {
+    team = std::make_unique<TeamVision>(getSize());
+    joinTeam(*team, trainer);
+    for (auto const entity : m_entities) {
+      if (trainerOf(*entity) == trainer.id) joinTeam(*team, *entity);
+    }
+  }
+
+  for (size_t i = 0; i < team->members.size(); i++) {
+    auto const& member = team->members[i];
+    if (!member.entity) continue;
+    auto const& vision = getVision(*member.entity);
+    if (member.vision == &vision && member.version == vision.version) continue;
+    mergeTeamMember(*team, i, vision);
+  }
 
-    m_fov.fieldOfVision(blocked);
-    result->offset = offset;
-    result->dirty = false;
+  thread_local std::vector<std::optional<VisionCells>> members;
+  members.clear();
+  for (auto const& member : team->members) {
+    auto& cells = members.emplace_back();
+    if (member.vision) cells.emplace(*member.vision);
+  }
+  for (auto const& [lo, hi] : team->stale) {
+    for (auto y = lo.y; y <= hi.y; y++) {
+      for (auto x = lo.x; x <= hi.x; x++) {
+        auto const p = Point{x, y};
+        auto value = -1;
+        for (size_t mask = 0; mask < team->seen.size(); mask++) {
+          auto bits = team->seen[mask].get(p);
+          for (; bits; bits &= bits - 1) {
+            auto const i = 32 * mask + __builtin_ctz(bits);
+            auto const offset = team->members[i].vision->offset;
+            value = std::max(value, members[i]->get(p + offset));
+          }
+        }
+        team->visibility.set(p, value);
+      }
+    }
+  }
+  team->stale.clear();
+  return *team;
+}
+
+std::vector<Entity*> Board::getObservers(Point p) const {
+  std::vector<Entity*> result;
+  forEachEntityInRange(p, [&](Entity& entity) {
+    if (canSee(entity, p)) result.push_back(&entity);
+  });
+  return result;
+}
+
+// We only refresh visions that are already cached, since those are the ones
+// that callers read: we don't allocate a vision for every entity. The workers
+// each write to a different vision. We list entities' visions in table order,
+// so that nearby visions are computed together. The visions left over at the
+// deadline stay dirty, for the next refresh or getVision to compute.
+void Board::refreshVisions(WorkerPool& pool, time_ns_t deadline) const {
+  std::vector<std::pair<Point, Vision*>> dirty;
+  for (auto const entity : m_table.entities) {
+    if (!entity) continue;
+    auto const vision = findVision(*entity);
+    if (vision && vision->dirty) dirty.push_back({entity->pos, vision});
+  }
+  for (auto const& [pos, vision] : m_pointVisions) {
+    if (vision->dirty) dirty.push_back({pos, vision});
   }
+  auto const batch = kRefreshesPerThread * (pool.threads() + 1);
+  for (size_t start = 0; start < dirty.size(); start += batch) {
+    if (epochTimeNanos() > deadline) break;
+    auto const count = std::min(batch, dirty.size() - start);
+    pool.run(count, [&](size_t i) {
+      computeVision(dirty[start + i].first, *dirty[start + i].second);
+    });
+  }
+}
+
+// Returns a dirty, full-circle vision with cells for the given radius.
+Vision* Board::takeVision(int32_t radius) const {
+  auto result = static_cast<Vision*>(nullptr);
+  if (m_freeVisions.empty()) {
+    result = &m_visionPool.emplace_back();
+  } else {
+    result = m_freeVisions.back();
+    m_freeVisions.pop_back();
+  }
+  result->radius = radius;
+  result->arc = 360;
+  result->facing = Point::origin();
+  result->offset = Point::origin();
+  result->dirty = true;
+  result->cells = m_visionSlabs[radius].allocate();
+  return result;
+}
+
+void Board::releaseVision(Vision* vision) const {
+  m_visionSlabs[vision->radius].release(vision->cells);
+  m_freeVisions.push_back(vision);
+}
+
+Vision* Board::findVision(const Entity& entity) const {
+  auto const index = entity.id.index();
+  return index < m_vision.size() ? m_vision[index] : nullptr;
+}
+
+Vision& Board::allocateVision(const Entity& entity) const {
+  auto const index = entity.id.index();
+  if (index >= m_vision.size()) m_vision.resize(m_entities.slots(), nullptr);
+  auto& result = m_vision[index];
+  if (result != nullptr) return *result;
+  result = takeVision(sightRadius(entity));
+  result->arc = sightArc(entity);
+  result->facing = entity.facing;
   return *result;
 }
 
-void Board::dirtyVision(const Entity& entity, const Point* target) {
-  auto const it = m_vision.find(&entity);
-  if (it == m_vision.end() || it->second->dirty) return;
-  if (target && !canSee(*it->second, *target)) return;
-  it->second->dirty = true;
+int32_t Board::addLight(Point p, int32_t radius) {
+  auto const light = [&]{
+    if (m_freeLights.empty()) {
+      m_lights.emplace_back();
+      return static_cast<int32_t>(m_lights.size() - 1);
+    }
+    auto const result = m_freeLights.back();
+    m_freeLights.pop_back();
+    return result;
+  }();
+  auto& entry = m_lights[light];
+  entry.pos = p;
+  entry.vision = takeVision(std::clamp(radius, 1, m_fov.radius));
+  entry.applied = false;
+  m_dirtyLights.push_back(light);
+  return light;
+}
+
+void Board::moveLight(int32_t light, Point p) {
+  auto& entry = m_lights[light];
+  assert(entry.vision != nullptr);
+  if (entry.pos == p) return;
+  entry.pos = p;
+  dirtyLight(light);
+}
+
+void Board::removeLight(int32_t light) {
+  auto& entry = m_lights[light];
+  assert(entry.vision != nullptr);
+  if (entry.applied) applyLight(*entry.vision, -1);
+  releaseVision(entry.vision);
+  entry.vision = nullptr;
+  entry.applied = false;
+  m_freeLights.push_back(light);
+}
+
+void Board::setAmbientLight(int32_t level) {
+  m_ambientLight = std::clamp(level, 0, kVisibilityRoot);
+}
+
+int32_t Board::lightAt(Point p) const {
+  assert(m_dirtyLights.empty());
+  return std::min(m_ambientLight + m_light.get(p), kVisibilityRoot);
+}
+
+// Each member has a bit in the cells' masks, so we add a mask whenever the
+// team outgrows the ones it has.
+void Board::joinTeam(TeamVision& team, const Entity& entity) const {
+  auto& members = team.members;
+  auto const it = std::find_if(members.begin(), members.end(),
+                               [](auto const& m) { return !m.entity; });
+  auto& member = it != members.end() ? *it : members.emplace_back();
+  if (members.size() > 32 * team.seen.size()) {
+    team.seen.emplace_back(getSize(), 0);
+  }
+  member = {};
+  member.entity = &entity;
+}
+
+// Removes an entity from its team, or drops its team if it's a trainer.
+void Board::leaveTeam(const Entity& entity) {
+  m_teams.erase(entity.id);
+  auto const it = m_teams.find(trainerOf(entity));
+  if (it == m_teams.end()) return;
+  auto& team = *it->second;
+  for (size_t i = 0; i < team.members.size(); i++) {
+    auto& member = team.members[i];
+    if (member.entity != &entity) continue;
+    if (member.vision) {
+      auto& seen = team.seen[i / 32];
+      auto const mask = ~(uint32_t{1} << (i % 32));
+      for (auto y = member.lo.y; y <= member.hi.y; y++) {
+        for (auto x = member.lo.x; x <= member.hi.x; x++) {
+          seen.set({x, y}, seen.get({x, y}) & mask);
+        }
+      }
+      team.stale.push_back({member.lo, member.hi});
+    }
+    member = {};
+  }
+}
+
+// Moves member i's bit from its old window to its new one, and leaves the
+// windows for the caller to redo: after a step, they overlap, so we leave the
+// box around both.
+void Board::mergeTeamMember(
+    TeamVision& team, size_t i, const Vision& vision) const {
+  auto& member = team.members[i];
+  auto& seen = team.seen[i / 32];
+  auto const bit = uint32_t{1} << (i % 32);
+  auto const old = member;
+  if (old.vision) {
+    for (auto y = old.lo.y; y <= old.hi.y; y++) {
+      for (auto x = old.lo.x; x <= old.hi.x; x++) {
+        seen.set({x, y}, seen.get({x, y}) & ~bit);
+      }
+    }
+  }
+
+  auto const size = getSize();
+  auto const radius = vision.radius;
+  auto const pos = Point{radius, radius} - vision.offset;
+  auto const cells = VisionCells(vision);
+  member.lo = {std::max(pos.x - radius, 0), std::max(pos.y - radius, 0)};
+  member.hi = {std::min(pos.x + radius, size.x - 1),
+               std::min(pos.y + radius, size.y - 1)};
+  for (auto y = member.lo.y; y <= member.hi.y; y++) {
+    for (auto x = member.lo.x; x <= member.hi.x; x++) {
+      if (cells.get(Point{x, y} + vision.offset) < 0) continue;
+      seen.set({x, y}, seen.get({x, y}) | bit);
+    }
+  }
+  member.vision = &vision;
+  member.version = vision.version;
+
+  auto const overlap = old.vision &&
+                       old.lo.x <= member.hi.x && member.lo.x <= old.hi.x &&
+                       old.lo.y <= member.hi.y && member.lo.y <= old.hi.y;
+  if (overlap) {
+    team.stale.push_back({{std::min(old.lo.x, member.lo.x),
+                           std::min(old.lo.y, member.lo.y)},
+                          {std::max(old.hi.x, member.hi.x),
+                           std::max(old.hi.y, member.hi.y)}});
+    return;
+  }
+  if (old.vision) team.stale.push_back({old.lo, old.hi});
+  team.stale.push_back({member.lo, member.hi});
+}
+
+// We merge a row at a time, in the part of the vision's window that's on the
+// map. The loops over a row are free of branches, so that they vectorize. The
+// entities in the window are few, so we look them up by block afterwards.
+void Board::updateKnowledge(const Vision& vision, Knowledge& knowledge) const {
+  assert(knowledge.size == getSize());
+  auto const stamp = ++knowledge.stamp;
+  auto const size = getSize();
+  auto const radius = vision.radius;
+  auto const corner = Point::origin() - vision.offset;
+  auto const lo = Point{std::max(corner.x, 0), std::max(corner.y, 0)};
+  auto const hi = Point{std::min(corner.x + 2 * radius, size.x - 1),
+                        std::min(corner.y + 2 * radius, size.y - 1)};
+  if (lo.x > hi.x || lo.y > hi.y) return;
+
+  auto const dark = m_ambientLight < kVisibilityRoot;
+  assert(!dark || m_dirtyLights.empty());
+  auto const ambient = m_ambientLight;
+  auto const cells = VisionCells(vision);
+  auto const n = hi.x - lo.x + 1;
+
+  for (auto y = lo.y; y <= hi.y; y++) {
+    auto const bits = cells.rows[y - corner.y] >> (lo.x - corner.x);
+    if (!bits) continue;
+    auto const start = lo.x + size.x * y;
+    auto const light = m_light.data() + start;
+    auto const tiles = m_map.data() + start;
+    auto const seen = knowledge.seen.data() + start;
+    auto const known = knowledge.tiles.data() + start;
+    auto const entities = knowledge.entities.data() + start;
+    for (auto x = 0; x < n; x++) {
+      auto const lit = !dark || ambient + light[x] > 0;
+      auto const visible = ((bits >> x) & 1) && lit;
+      seen[x] = std::max(seen[x], visible ? stamp : 0);
+      known[x] = visible ? tiles[x] : known[x];
+      entities[x] = visible ? kNoEntity : entities[x];
+    }
+  }
+
+  auto const a = blockOf(lo), b = blockOf(hi);
+  for (auto y = a.y; y <= b.y; y++) {
+    for (auto x = a.x; x <= b.x; x++) {
+      auto const it = m_entitiesByBlock.find(Point{x, y});
+      if (it == m_entitiesByBlock.end()) continue;
+      for (auto const entity : it->second) {
+        if (!knowledge.sees(entity->pos)) continue;
+        auto const& p = entity->pos;
+        knowledge.entities[p.x + size.x * p.y] = entity->glyph;
+      }
+    }
+  }
+}
+
+// In full daylight, every cell is fully lit, so lights make no difference to
+// what entities see, and we skip reading the light map.
+int32_t Board::lit(Point p, int32_t visibility) const {
+  if (visibility < 0 || m_ambientLight >= kVisibilityRoot) return visibility;
+  auto const light = lightAt(p);
+  return light > 0 ? std::min(visibility, light) : -1;
+}
+
+// Lights are updated lazily, on the next call to updateLights.
+void Board::dirtyLight(int32_t light) {
+  auto const vision = m_lights[light].vision;
+  if (!vision || vision->dirty) return;
+  vision->dirty = true;
+  m_dirtyLights.push_back(light);
+}
+
+void Board::applyLight(const Vision& vision, int32_t sign) {
+  auto const radius = vision.radius;
+  auto const center = Point{radius, radius};
+  auto const pos = center - vision.offset;
+  auto const map = VisionCells(vision);
+  for (auto y = 0; y < map.side; y++) {
+    for (auto bits = map.rows[y]; bits; bits &= bits - 1) {
+      auto const d = Point{__builtin_ctz(bits), y} - center;
+      auto const distance = std::max(std::abs(d.x), std::abs(d.y));
+      auto const p = pos + d;
+      m_light.set(p, m_light.get(p) + sign * lightFalloff(distance, radius));
+    }
+  }
+}
+
+// A dirty light's vision still holds the cells that its contribution came
+// from, so we take that contribution away before we recompute the vision.
+void Board::updateLights() {
+  for (auto const i : m_dirtyLights) {
+    auto& light = m_lights[i];
+    if (!light.vision || !light.vision->dirty) continue;
+    if (light.applied) applyLight(*light.vision, -1);
+    computeVision(light.pos, *light.vision);
+    applyLight(*light.vision, 1);
+    light.applied = true;
+  }
+  m_dirtyLights.clear();
+}
+
+// The vision of a point with no opaque tiles in range. Cells' visibilities
+// only depend on the tiles around them, so we cast it on an open board, once
+// for each engine and radius.
+const Vision& Board::openVision(int32_t radius) const {
+  auto const radii = m_fov.radius + 1;
+  static const auto result = [&]{
+    std::vector<std::unique_ptr<OwnedVision>> result;
+    auto const side = 2 * m_fov.radius + 1;
+    auto const center = Point{m_fov.radius, m_fov.radius};
+    Board board({side, side});
+    board.clearAllTiles();
+    for (auto const engine : {FOVEngine::Trie, FOVEngine::Bitboard,
+                              FOVEngine::Shadowcast}) {
+      board.m_fovEngine = engine;
+      for (auto r = 0; r < radii; r++) {
+        result.push_back(std::make_unique<OwnedVision>(r));
+        board.castVision(center, result.back()->vision);
+      }
+    }
+    return result;
+  }();
+  return result[static_cast<int32_t>(m_fovEngine) * radii + radius]->vision;
+}
+
+void Board::computeVision(Point pos, Vision& vision) const {
+  auto const radius = vision.radius;
+  auto const span = Point{radius, radius};
+  if (isOpenArea(pos - span, pos + span)) {
+    vision.offset = span - pos;
+    auto const& open = openVision(radius);
+    std::copy_n(open.cells, visionWords(radius), vision.cells);
+    if (vision.arc < 360 && vision.facing != Point::origin()) {
+      auto const& arc = fovArcs().get(vision.facing, vision.arc);
+      auto map = VisionCells(vision);
+      for (auto const& p : arc.outside) map.set(p + span, -1);
+    }
+  } else {
+    castVision(pos, vision);
+  }
+  vision.dirty = false;
+  vision.version++;
+}
+
+void Board::castVision(Point pos, Vision& vision) const {
+  auto const radius = vision.radius;
+  vision.offset = Point{radius, radius} - pos;
+  VisionCells(vision).clear();
+  if (vision.arc < 360 && vision.facing != Point::origin()) {
+    return computeVisionArc(pos, vision);
+  }
+  switch (m_fovEngine) {
+    case FOVEngine::Trie: computeVisionTrie(pos, vision); break;
+    case FOVEngine::Bitboard: computeVisionBitboard(pos, vision); break;
+    case FOVEngine::Shadowcast: computeVisionShadowcast(pos, vision); break;
+  }
+}
+
+// The trie engines walk just the nodes that the cells in the arc depend on,
+// then hide the cells outside of it that they reached along the way. Both
+// engines would compute the same values, so they share this walk. Shadowcast
+// has no such subset, so it casts in full and then hides the cells outside.
+void Board::computeVisionArc(Point pos, Vision& vision) const {
+  auto const& arc = fovArcs().get(vision.facing, vision.arc);
+  auto const radius = vision.radius;
+  auto const center = Point{radius, radius};
+
+  if (m_fovEngine == FOVEngine::Shadowcast) {
+    computeVisionShadowcast(pos, vision);
+    auto cells = VisionCells(vision);
+    for (auto const& p : arc.outside) cells.set(p + center, -1);
+    return;
+  }
+
+  auto const& table = visibilityLevels();
+  auto const zero = table.values.size() - 1;
+  auto& map = scratchLevels(radius);
+  auto cells = VisionCells(vision);
+  auto const nodes = m_fov.nodes;
+  auto const limit = static_cast<int32_t>(sightSize(radius));
+  // A node is open if its stamp is this walk's, so we never clear the stamps,
+  // except when the walk counter wraps.
+  thread_local std::vector<uint32_t> open;
+  thread_local uint32_t walk = 0;
+  if (open.size() != m_fov.size || ++walk == 0) {
+    open.assign(m_fov.size, 0);
+    walk = 1;
+  }
+  open[0] = walk;
+
+  for (auto const i : arc.nodes) {
+    if (i >= limit) break;
+    if (open[i] != walk) continue;
+    auto const& node = nodes[i];
+    auto const level = [&]() -> uint8_t {
+      if (node.parent < 0) return 0;
+      auto const& prev = nodes[node.parent].point;
+      auto const diagonal = node.point.x != prev.x && node.point.y != prev.y;
+      auto const& tile = *m_map.get(node.point + pos);
+      return levelStep(table, map.get(prev + center), tile, diagonal);
+    }();
+    auto const key = node.point + center;
+    map.set(key, std::min(level, map.get(key)));
+    cells.show(key);
+    if (level == zero || !continuesPast(node.point, radius)) continue;
+    std::fill_n(open.begin() + node.child, node.children, walk);
+  }
+
+  cells.assignLevels(map);
+  for (auto const& p : arc.hidden) cells.set(p + center, -1);
+}
+
+void Board::computeVisionTrie(Point pos, Vision& vision) const {
+  auto const radius = vision.radius;
+  auto const offset = vision.offset;
+  auto const& table = visibilityLevels();
+  auto const zero = table.values.size() - 1;
+  auto& map = scratchLevels(radius);
+  auto cells = VisionCells(vision);
+
+  auto const blocked = [&](Point p, const Point* parent) {
+    auto const q = p + pos;
+    auto const level = [&]() -> uint8_t {
+      if (!parent) return 0;
+      auto const diagonal = p.x != parent->x && p.y != parent->y;
+      auto const prev = map.get(*parent + pos + offset);
+      return levelStep(table, prev, *m_map.get(q), diagonal);
+    }();
+
+    auto const key = q + offset;
+    map.set(key, std::min(level, map.get(key)));
+    cells.show(key);
+    return level == zero || !continuesPast(p, radius);
+  };
+
+  m_fov.fieldOfVision(blocked, sightSize(radius));
+  cells.assignLevels(map);
+}
+
+void Board::computeVisionBitboard(Point pos, Vision& vision) const {
+  auto const& lanes = fovLanes();
+  switch (lanes.words) {
+    case 1: return bitboardFOV<1>(lanes, m_blocked, m_obscure, pos, vision);
+    case 2: return bitboardFOV<2>(lanes, m_blocked, m_obscure, pos, vision);
+    case 3: return bitboardFOV<3>(lanes, m_blocked, m_obscure, pos, vision);
+    case 4: return bitboardFOV<4>(lanes, m_blocked, m_obscure, pos, vision);
+  }
+  assert(false);
+}
+
+void Board::computeVisionShadowcast(Point pos, Vision& vision) const {
+  auto const offset = vision.offset;
+  auto const side = 2 * vision.radius + 1;
+  thread_local Matrix<int32_t> map;
+  if (map.size() != Point{side, side}) map = Matrix<int32_t>({side, side}, -1);
+  map.fill(-1);
+
+  // Cells that we scan but don't reveal still pass light on to the cells
+  // behind them, so until we copy the cells into the vision, we store their
+  // visibility v as -2 - v. Revealed cells and unscanned ones (-1) are stored
+  // as usual.
+  auto const light = [&](Point key) {
+    auto const value = map.get(key);
+    return value >= -1 ? value : -2 - value;
+  };
+
+  // Like the trie, we let light reach a cell from the neighbours one step
+  // closer to the origin along its major axis or its diagonal.
+  auto const visibility = [&](Point p) -> int32_t {
+    if (p == Point::origin()) return kVisibilityRoot;
+    auto const& tile = *m_map.get(p + pos);
+    auto const step = [&](Point parent, bool diagonal) {
+      return visibilityStep(light(parent + pos + offset), tile, diagonal);
+    };
+    auto const ax = std::abs(p.x), ay = std::abs(p.y);
+    auto const sx = p.x < 0 ? -1 : 1, sy = p.y < 0 ? -1 : 1;
+    auto result = 0;
+    if (ax && ay) result = step({p.x - sx, p.y - sy}, true);
+    if (ax > ay) result = std::max(result, step({p.x - sx, p.y}, false));
+    if (ay > ax) result = std::max(result, step({p.x, p.y - sy}, false));
+    return result;
+  };
+
+  // We scan one cell past the radius and only reveal the cells that the trie
+  // reaches. Cells out of range cast no shadows, as in the trie.
+  auto const visit = [&](Point p, bool symmetric) {
+    if (sightRadiusAt(p) > vision.radius) return false;
+    auto const key = p + pos + offset;
+    auto const value = visibility(p);
+    auto const prev = map.get(key);
+    if (symmetric || value <= 0) {
+      map.set(key, std::max(value, light(key)));
+    } else if (prev < 0) {
+      map.set(key, std::min(-2 - value, prev));
+    }
+    return value <= 0;
+  };
+
+  shadowcast(vision.radius + 1, visit);
+
+  auto cells = VisionCells(vision);
+  for (auto y = 0; y < side; y++) {
+    for (auto x = 0; x < side; x++) {
+      auto const value = map.get({x, y});
+      if (value >= 0) cells.set({x, y}, value);
+    }
+  }
+}
+
+// Calls fn on each entity whose vision's window includes p.
+template <typename Fn>
+void Board::forEachEntityInRange(Point p, Fn fn) const {
+  auto const radius = m_fov.radius;
+  auto const lo = blockOf(p - Point{radius, radius});
+  auto const hi = blockOf(p + Point{radius, radius});
+  for (auto y = lo.y; y <= hi.y; y++) {
+    for (auto x = lo.x; x <= hi.x; x++) {
+      auto const it = m_entitiesByBlock.find(Point{x, y});
+      if (it == m_entitiesByBlock.end()) continue;
+      for (auto const entity : it->second) {
+        auto const d = entity->pos - p;
+        auto const distance = std::max(std::abs(d.x), std::abs(d.y));
+        if (distance <= sightRadius(*entity)) fn(*entity);
+      }
+    }
+  }
+}
+
+void Board::indexEntity(Entity& entity, bool insert) {
+  auto const block = blockOf(entity.pos);
+  if (insert) {
+    m_entitiesByBlock[block].push_back(&entity);
+    return;
+  }
+  auto const it = m_entitiesByBlock.find(block);
+  assert(it != m_entitiesByBlock.end());
+  auto& entities = it->second;
+  auto const found = std::find(entities.begin(), entities.end(), &entity);
+  assert(found != entities.end());
+  *found = entities.back();
+  entities.pop_back();
+  if (entities.empty()) m_entitiesByBlock.erase(it);
+}
+
+void Board::countOpaqueTiles() {
+  auto const size = getSize();
+  auto const block = 1 << kBlockBits;
+  auto const blocks = Point{(size.x + block - 1) >> kBlockBits,
+                            (size.y + block - 1) >> kBlockBits};
+  m_opaqueByBlock = Matrix<int32_t>(blocks, 0);
+  auto const mask = (FlagBlocked | FlagObscure);
+  for (auto y = 0; y < size.y; y++) {
+    for (auto x = 0; x < size.x; x++) {
+      if (!(m_map.get({x, y})->flags & mask)) continue;
+      auto const block = blockOf({x, y});
+      m_opaqueByBlock.set(block, m_opaqueByBlock.get(block) + 1);
+    }
+  }
+}
+
+// Sets or clears the bit for p in each neighbour's free steps.
+void Board::updateFreeSteps(Point p) {
+  auto const free = getStatus(p) == Status::Free;
+  for (size_t i = 0; i < std::size(kSteps); i++) {
+    auto const q = p - kSteps[i];
+    auto const bit = static_cast<uint8_t>(1 << i);
+    auto const steps = m_freeSteps.get(q);
+    m_freeSteps.set(q, free ? steps | bit : steps & ~bit);
+  }
+}
+
+void Board::countFreeSteps() {
+  auto const size = getSize();
+  m_freeSteps.fill(0);
+  for (auto y = 0; y < size.y; y++) {
+    for (auto x = 0; x < size.x; x++) {
+      if (getStatus({x, y}) == Status::Free) updateFreeSteps({x, y});
+    }
+  }
+}
+
+void Board::dirtyVision(Vision& vision, const Point* target) {
+  if (vision.dirty) return;
+
+  // Visions of an arc, and shadowcast ones, hide cells that visible cells
+  // depend on, so we can't tell if a change matters. Callers only pass us
+  // changes in range.
+  if (vision.arc < 360 || m_fovEngine == FOVEngine::Shadowcast) {
+    vision.dirty = true;
+    return;
+  }
+  if (target && visibilityIn(vision, *target) < 0) return;
+
+  // Trie-based visions can be patched in place when a tile changes.
+  if (!target || !repairVision(vision, {*target})) vision.dirty = true;
+}
+
+// When an entity takes a single step, its trie-based vision stays in place,
+// relative to the entity. From there, it's as if the tiles at some relative
+// offsets changed, so we repair the vision at the cells where they did. Only
+// cells we could see before the step matter: if no node at a cell was walked,
+// its tile affected nothing. In open terrain, a step is nearly free; in
+// cluttered terrain, and after a teleport, we fall back to a full recompute.
+void Board::moveVision(const Entity& entity, Point from) {
+  auto const found = findVision(entity);
+  if (!found || found->dirty) return;
+  auto& vision = *found;
+
+  auto const step = entity.pos - from;
+  auto const distance = std::max(std::abs(step.x), std::abs(step.y));
+  auto const shadowcast = m_fovEngine == FOVEngine::Shadowcast;
+  if (distance > 1 || shadowcast || vision.arc < 360) {
+    vision.dirty = true;
+    return;
+  }
+
+  auto const radius = vision.radius;
+  auto const center = Point{radius, radius};
+  auto const limit = sightSize(radius) / kRepairBudget;
+  auto const side = 2 * radius + 1;
+  auto const map = VisionCells(vision);
+  assert(side <= 64);
+
+  // We compare the tiles around the two positions a row at a time. The
+  // subtrees at the changed cells estimate the cost of the repair.
+  thread_local std::vector<Point> changed;
+  changed.clear();
+  size_t cost = 0;
+  for (auto y = 0; y < side; y++) {
+    auto const a = from + Point{-radius, y - radius};
+    auto const b = entity.pos + Point{-radius, y - radius};
+    auto diff = (m_blocked.getRow(a, side) ^ m_blocked.getRow(b, side)) |
+                (m_obscure.getRow(a, side) ^ m_obscure.getRow(b, side));
+    for (; diff; diff &= diff - 1) {
+      auto const key = Point{__builtin_ctzll(diff), y};
+      if (key == center || map.get(key) < 0) continue;
+      auto const p = key - center;
+      cost += m_fov.subtrees[m_fov.cellIndex(p)];
+      if (cost > limit) {
+        vision.dirty = true;
+        return;
+      }
+      changed.push_back(p + entity.pos);
+    }
+  }
+
+  auto const offset = vision.offset;
+  vision.offset = center - entity.pos;
+  if (repairVision(vision, changed)) return;
+  vision.offset = offset;
+  vision.dirty = true;
+}
+
+// Recomputes the part of a clean trie-based vision that depends on the tiles
+// at the changed points. A node's value depends only on its tile and on the
+// value of its parent's cell, so we re-walk every node at a changed cell and,
+// transitively, every node at a cell with a child among those nodes. Parents
+// outside that set keep their old values, which we recover from the map.
+//
+// A repaired node costs several times as much as a walked one, so when the
+// set is too large, we leave the vision untouched and return false.
+bool Board::repairVision(
+    Vision& vision, const std::vector<Point>& changed) const {
+  auto const radius = vision.radius;
+  auto const center = Point{radius, radius};
+  auto const pos = center - vision.offset;
+  auto const nodes = m_fov.nodes;
+  auto map = VisionCells(vision);
+
+  constexpr int32_t kUnknown = -2;
+  thread_local std::vector<uint8_t> marked;
+  thread_local std::vector<int32_t> values, cells, affected, touched, chain;
+  auto const side = static_cast<size_t>(2 * m_fov.radius + 1);
+  marked.resize(side * side, 0);
+  values.resize(m_fov.size, kUnknown);
+  cells.clear();
+  affected.clear();
+  touched.clear();
+
+  auto const mark = [&](Point p) {
+    auto const cell = m_fov.cellIndex(p);
+    if (cell < 0 || marked[cell]) return;
+    marked[cell] = 1;
+    cells.push_back(cell);
+  };
+  auto const limit = sightSize(radius) / kRepairBudget;
+  for (auto const& p : changed) {
+    if (p == pos) continue;
+    auto const cell = m_fov.cellIndex(p - pos);
+    if (cell >= 0 && static_cast<size_t>(m_fov.subtrees[cell]) > limit) {
+      return false;
+    }
+  }
+  for (auto const& p : changed) {
+    if (p != pos) mark(p - pos);
+  }
+  for (size_t i = 0; i < cells.size() && affected.size() <= limit; i++) {
+    auto const cell = cells[i];
+    for (auto j = m_fov.cells[cell]; j < m_fov.cells[cell + 1]; j++) {
+      auto const& node = nodes[m_fov.cell_nodes[j]];
+      auto const children = continuesPast(node.point, radius);
+      for (auto k = 0; k < node.children && children; k++) {
+        mark(nodes[node.child + k].point);
+      }
+      affected.push_back(m_fov.cell_nodes[j]);
+    }
+  }
+  if (affected.size() > limit) {
+    for (auto const cell : cells) marked[cell] = 0;
+    return false;
+  }
+  for (auto const i : affected) map.set(nodes[i].point + center, -1);
+  std::sort(affected.begin(), affected.end());
+
+  // The value of node i as of the last walk, or -1 if the walk skipped it.
+  auto const value = [&](int32_t i) -> int32_t {
+    auto const parent = nodes[i].parent;
+    if (parent < 0) return kVisibilityRoot;
+    if (values[parent] <= 0) return -1;
+    auto const& node = nodes[i];
+    auto const& prev = nodes[parent].point;
+    if (!continuesPast(prev, radius)) return -1;
+    auto const diagonal = node.point.x != prev.x && node.point.y != prev.y;
+    auto const& tile = *m_map.get(node.point + pos);
+    return visibilityStep(map.get(prev + center), tile, diagonal);
+  };
+
+  // Nodes outside the affected set are evaluated root-first, and memoized.
+  auto const unaffected = [&](int32_t i) {
+    chain.clear();
+    for (auto j = i; j >= 0 && values[j] == kUnknown; j = nodes[j].parent) {
+      chain.push_back(j);
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); it++) {
+      values[*it] = value(*it);
+      touched.push_back(*it);
+    }
+    return values[i];
+  };
+
+  for (auto const i : affected) {
+    auto const parent = nodes[i].parent;
+    if (!marked[m_fov.cellIndex(nodes[parent].point)]) unaffected(parent);
+    auto const result = value(i);
+    values[i] = result;
+    touched.push_back(i);
+    if (result < 0) continue;
+    auto const key = nodes[i].point + center;
+    map.set(key, std::max(result, map.get(key)));
+  }
+
+  for (auto const i : touched) values[i] = kUnknown;
+  for (auto const cell : cells) marked[cell] = 0;
+  vision.version++;
+  return true;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -322,38 +1986,133 @@ void processInput(State& state, Input input) {
   if (dir) state.input = MoveAction{*dir};
 }
 
+EntityRNG& streamOf(State& state, const Entity& entity) {
+  auto const index = entity.id.index();
+  auto& streams = state.streams;
+  if (streams.size() <= index) streams.resize(index + 1);
+  auto& stream = streams[index];
+  if (stream.first != entity.id) stream = {entity.id, EntityRNG(state.rng())};
+  return stream.second;
+}
+
+// Plans a batch of the turns left in this round in parallel, against the
+// board as it is now. Planning only reads the board, and each entity plans
+// with its own RNG, so the plans don't depend on the number of workers. Any
+// RNGs that we need are set up beforehand, in turn order.
+void planTurns(State& state) {
+  auto& plans = state.plans;
+  plans.clear();
+  state.next_plan = 0;
+
+  std::vector<const Entity*> turns;
+  for (auto const entity : state.board.getPendingEntities(kPlanBatch)) {
+    if (entity->id == state.player) continue;
+    streamOf(state, *entity);
+    turns.push_back(entity);
+    plans.push_back({entity->id, IdleAction{}});
+  }
+
+  auto const tasks = (turns.size() + kPlansPerTask - 1) / kPlansPerTask;
+  state.pool.run(tasks, [&](size_t task) {
+    auto input = MaybeAction{};
+    auto const start = task * kPlansPerTask;
+    auto const limit = std::min(start + kPlansPerTask, turns.size());
+    for (auto i = start; i < limit; i++) {
+      auto const& entity = *turns[i];
+      auto& rng = state.streams[entity.id.index()].second;
+      plans[i].second = plan(entity, input, rng);
+    }
+  });
+}
+
+// Returns the action for the ready entity's turn, planning the next batch if
+// we've acted out the last one. The player plans here, as does any entity
+// taking a turn that we didn't plan for, like a second turn in a round.
+Action planTurn(State& state, const Entity& entity) {
+  auto& plans = state.plans;
+  auto& next = state.next_plan;
+  if (entity.id != state.player) {
+    while (next < plans.size() && plans[next].first != entity.id &&
+           !state.board.getEntity(plans[next].first)) {
+      next++;
+    }
+    if (next == plans.size()) planTurns(state);
+    if (next < plans.size() && plans[next].first == entity.id) {
+      return std::move(plans[next++].second);
+    }
+  }
+  return plan(entity, state.input, streamOf(state, entity));
+}
+
+// Turns are planned in batches, then acted out one at a time in turn order.
+// act checks each move against the board as it is by then, so a move into a
+// cell that an earlier turn in the batch took fails, as it always did.
 void updateState(State& state, std::deque<Input>& inputs) {
   auto& board = state.board;
-  auto& player = *state.player;
+  auto const player = board.getEntity(state.player);
 
-  if (!player.removed && &player == &board.getActiveEntity()) {
+  if (player && player == &board.getReadyEntity()) {
     while (!inputs.empty() && !state.input) {
       processInput(state, inputs.front());
       inputs.pop_front();
     }
   }
 
-  while (!player.removed) {
-    auto& entity = board.getActiveEntity();
-    if (!turnReady(entity)) {
-      board.advanceEntity();
-      continue;
+  auto const deadline = epochTimeNanos() + kUpdateBudget;
+  state.deferred_this_round = 0;
+
+  // We recompute stale cached visions up front, spread over the workers, so
+  // that turns and rendering read them instead of computing each one on this
+  // thread when it's first needed. They share the update's budget.
+  board.refreshVisions(state.pool, deadline);
+
+  // Turns may change tiles and lights, and the reads made while planning and
+  // rendering must see those changes, so we apply them before each turn and
+  // once more after the last one.
+  while (board.getEntity(state.player)) {
+    board.updateLights();
+    auto& entity = board.getReadyEntity();
+    if (entity.id != state.player && epochTimeNanos() > deadline) {
+      state.deferred_this_round = board.getPendingTurns();
+      break;
     }
-    auto const action = plan(entity, state.input, state.rng);
+    auto const action = planTurn(state, entity);
     auto const result = act(board, entity, action);
-    if (!result.success && &entity == &player) break;
-    wait(entity, result.moves, result.turns);
+    if (!result.success && entity.id == state.player) break;
+    wait(board, entity, result.moves, result.turns);
   }
+  board.updateLights();
+}
+
+// Each trainer on the board merges its vision into its own knowledge, which
+// we make on its first merge. We drop the knowledge of trainers that are gone.
+void updateTrainerKnowledge(State& state) {
+  auto const& board = state.board;
+  for (auto const entity : board.getEntities()) {
+    auto const trainer = entity->match(
+      [](const Pokemon&) { return false; },
+      [](const Trainer&) { return true; }
+    );
+    if (!trainer) continue;
+    auto& knowledge = state.knowledge[entity->id];
+    if (!knowledge) knowledge = std::make_unique<Knowledge>(board.getSize());
+    board.updateKnowledge(board.getVision(*entity), *knowledge);
+  }
+  absl::erase_if(state.knowledge, [&](const auto& entry) {
+    return board.getEntity(entry.first) == nullptr;
+  });
 }
 
 void update(State& state, std::deque<Input>& inputs) {
   updateState(state, inputs);
-  //updatePlayerKnowledge(state);
+  updateTrainerKnowledge(state);
 }
 
 } // namespace
 
-State::State() : board({kMapSize, kMapSize}) {
+State::State()
+    : board({kMapSize, kMapSize}),
+      pool(std::max(std::thread::hardware_concurrency(), 1u) - 1) {
   auto const size = board.getSize();
   auto const start = Point{size.x / 2, size.y / 2};
   while (true) {
@@ -362,8 +2121,8 @@ State::State() : board({kMapSize, kMapSize}) {
     if (board.getStatus(start) == Status::Free) break;
   }
 
-  player = new Trainer("", start, true, kTrainerHP, kTrainerSpeed);
-  board.addEntity(OwnedEntity(player));
+  player = board.addEntity<Trainer>("", start, true, kTrainerHP,
+                                   kTrainerSight, kTrainerSpeed).id;
 
   auto dx = die(board.getSize().x);
   auto dy = die(board.getSize().y);
@@ -375,7 +2134,7 @@ State::State() : board({kMapSize, kMapSize}) {
       }
       return std::nullopt;
     }();
-    if (pos) board.addEntity(OwnedEntity(new Pokemon("Pidgey", *pos)));
+    if (pos) board.addEntity<Pokemon>("Pidgey", *pos);
   }
 }
 
@@ -383,9 +2142,19 @@ State::State() : board({kMapSize, kMapSize}) {
 
 namespace {
 
+// Cells that the player remembers but can't see are drawn in gray, with the
+// entity last seen on them, if any.
+Glyph dim(Glyph glyph) {
+  return {glyph.ch, kGray, kNone};
+}
+
 void render(const State& state, Matrix<Glyph>& frame) {
   auto const& board = state.board;
-  auto const& vision = board.getVision(*state.player);
+  auto const player = board.getEntity(state.player);
+  auto const it = state.knowledge.find(state.player);
+  if (!player || it == state.knowledge.end()) return;
+  auto const& knowledge = *it->second;
+  auto const& vision = board.getVision(*player);
 
   auto const offset = Point::origin();
   auto const size = board.getSize();
@@ -395,13 +2164,20 @@ void render(const State& state, Matrix<Glyph>& frame) {
     for (auto x = 0; x < size.x; x++) {
       auto const p = Point{x, y};
       auto const seen = board.canSee(vision, p);
-      frame.set(map(p), seen ? board.getTile(p).glyph : Empty());
+      auto const known = knowledge.getTile(p);
+      auto const glyph = seen ? board.getTile(p).glyph
+                       : known ? dim(known->glyph) : Empty();
+      frame.set(map(p), glyph);
+      if (seen || !known) continue;
+      auto const entity = knowledge.getEntity(p);
+      if (entity) frame.set(map(p), dim(*entity));
     }
   }
 
-  for (const auto& entity : board.getEntities()) {
-    auto const seen = board.canSee(vision, entity->pos);
-    if (seen) frame.set(map(entity->pos), entity->glyph);
+  auto const& table = board.getEntityTable();
+  for (size_t i = 0; i < table.size(); i++) {
+    if (!table.entities[i] || !board.canSee(vision, table.pos[i])) continue;
+    frame.set(map(table.pos[i]), table.glyphs[i]);
   }
 }
 
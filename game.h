@@ -1,6 +1,7 @@
 #pragma once
 
 #include <deque>
+#include <list>
 #include <memory>
 #include <random>
 #include <string>
@@ -9,11 +10,19 @@
 #include "base.h"
 #include "entity.h"
 #include "geo.h"
+#include "pool.h"
 
 //////////////////////////////////////////////////////////////////////////////
 
 enum struct Status { Free, Blocked, Occupied };
 
+// The steps to a cell's neighbours. Bit i of a cell's free steps is set if
+// the cell one step of kSteps[i] away is free.
+constexpr Point kSteps[] = {
+  {-1,  0}, {0,  1}, { 0, -1}, {1, 0},
+  {-1, -1}, {1, -1}, {-1,  1}, {1, 1},
+};
+
 using TileFlags = uint8_t;
 constexpr static TileFlags FlagNone    = 0x0;
 constexpr static TileFlags FlagBlocked = 0x1;
@@ -36,14 +45,115 @@ inline const Tile* tileType(char ch) {
 
 //////////////////////////////////////////////////////////////////////////////
 
+// The trie and bitboard engines compute identical visions: the trie engine
+// walks one node at a time, and the bitboard engine advances every ray of the
+// trie in lockstep. The shadowcast engine applies the same attenuation rule,
+// but it uses symmetric shadowcasting to decide which cells are in view.
+enum struct FOVEngine { Trie, Bitboard, Shadowcast };
+
+// A vision covers the cells within its radius of the point it was cast from.
+// Radii range up to the radius of the shared FOV trie. With an arc under 360
+// degrees, it only covers the cells within half of the arc of its facing.
+//
+// Its cells are a record of 32-bit words: one word of visibility bits per row,
+// then a 4-bit level per cell, which indexes the few values that visibility
+// can take. A board keeps the records of its visions in slabs. Its version
+// changes whenever its cells do.
 struct Vision {
+  Vision() {}
+
+  int32_t radius = 0;
+  int32_t arc = 360;
+  Point facing;
   Point offset;
   bool dirty = true;
-  Matrix<int32_t> visibility;
+  uint32_t version = 0;
+  uint32_t* cells = nullptr;
 
   DISALLOW_COPY_AND_ASSIGN(Vision);
 };
 
+// Fixed-size records, allocated in chunks so that they never move.
+struct VisionSlab {
+  explicit VisionSlab(size_t words) : m_words(words) {}
+
+  uint32_t* allocate();
+  void release(uint32_t* record);
+
+private:
+  size_t m_words;
+  std::vector<std::unique_ptr<uint32_t[]>> m_chunks;
+  std::vector<uint32_t*> m_free;
+
+  DISALLOW_COPY_AND_ASSIGN(VisionSlab);
+};
+
+// The union of the visions of a trainer and its Pokemon, over the cells of
+// the board: a cell's visibility is the max over the members that see it. Each
+// cell has a bit for each member that sees it, in one mask per 32 members, so
+// when a member's vision changes, we only redo the cells in its old and new
+// windows.
+struct TeamVision {
+  explicit TeamVision(Point size);
+
+  // The part of a member's vision that's merged in, as of a version of it.
+  // A member's slot is free if it has no entity.
+  struct Member {
+    const Entity* entity = nullptr;
+    const Vision* vision = nullptr;
+    uint32_t version = 0;
+    Point lo;
+    Point hi;
+  };
+
+  std::vector<Member> members;
+  std::vector<std::pair<Point, Point>> stale;
+  std::vector<Matrix<uint32_t>> seen;
+  Matrix<int32_t> visibility;
+
+  DISALLOW_COPY_AND_ASSIGN(TeamVision);
+};
+
+// What a trainer remembers of the board: for each cell, its tile and the
+// glyph of the entity on it, if any, as of the last merge that saw it. Each
+// merge has a stamp, starting from 1, and each cell has the stamp of the last
+// merge that saw it, or 0 if none has.
+struct Knowledge {
+  explicit Knowledge(Point size);
+
+  bool sees(Point p) const;
+  const Tile* getTile(Point p) const;
+  std::optional<Glyph> getEntity(Point p) const;
+
+  Point size;
+  uint32_t stamp = 0;
+  std::vector<uint32_t> seen;
+  std::vector<const Tile*> tiles;
+  std::vector<Glyph> entities;
+
+  DISALLOW_COPY_AND_ASSIGN(Knowledge);
+};
+
+// The fields of each entity that the turn loop and rendering read, in dense
+// arrays, one row per entity. Rows are ordered along a Hilbert curve over the
+// entities' positions, and entities take turns in row order. Rows of removed
+// entities have no entity until the next sort drops them.
+//
+// Positions and glyphs mirror the entities' own. Timers only live here, and
+// the charge that a round takes off them comes from the entity's speed. Each
+// round charges every entity that isn't ready yet, so when an entity's turn
+// ends we apply all of the charges up to its next turn at once.
+struct EntityTable {
+  size_t size() const { return entities.size(); }
+
+  std::vector<Entity*> entities;
+  std::vector<Point> pos;
+  std::vector<Glyph> glyphs;
+  std::vector<int32_t> move_timers;
+  std::vector<int32_t> turn_timers;
+  std::vector<int32_t> charges;
+};
+
 struct Board {
   explicit Board(Point size);
 
@@ -52,20 +162,37 @@ struct Board {
   Point getSize() const;
 
   Status getStatus(Point p) const;
+  uint8_t getFreeSteps(Point p) const;
   const Tile& getTile(Point p) const;
 
-  Entity& getActiveEntity();
+  // True if no tile in the rectangle from lo to hi, inclusive, blocks or
+  // obscures vision. Cells off the map count as blocked.
+  bool isOpenArea(Point lo, Point hi) const;
+
   Entity* getEntity(Point p);
-  const std::vector<Entity*>& getEntities() const;
+  Entity* getEntity(EntityId id) const;
+  const EntityMap& getEntities() const;
+  const EntityTable& getEntityTable() const;
 
   // Writes
 
   void clearAllTiles();
   void setTile(Point p, const Tile* tile);
-  void addEntity(OwnedEntity entity);
+  template <typename T, typename... Args>
+  T& addEntity(Args&&... args);
   void moveEntity(Entity& entity, Point to);
+  void turnEntity(Entity& entity, Point facing);
   void removeEntity(Entity& entity);
-  void advanceEntity();
+  void setFOVEngine(FOVEngine engine);
+
+  // Turns are scheduled: getReadyEntity returns the next entity to act, and
+  // delayEntity, which may only be called on that entity, ends its turn.
+  // getPendingTurns counts the turns left in this round, the ready one too,
+  // and getPendingEntities lists their entities in turn order, up to a limit.
+  Entity& getReadyEntity();
+  void delayEntity(Entity& entity, int32_t moves, int32_t turns);
+  size_t getPendingTurns() const;
+  std::vector<Entity*> getPendingEntities(size_t limit) const;
 
   // Cached field-of-vision
 
@@ -73,21 +200,165 @@ struct Board {
   bool canSee(const Vision& vision, Point point) const;
   int32_t visibilityAt(const Entity& entity, Point point) const;
   int32_t visibilityAt(const Vision& vision, Point point) const;
+
+  // The visibility of a point from another, or of each pair's second point
+  // from its first, with a full-circle vision of the given radius. Like
+  // visibilityAt, they account for light, but they don't fill any cache.
+  int32_t visibilityBetween(Point from, Point to, int32_t radius) const;
+  std::vector<int32_t> visibilityBetween(
+      const std::vector<std::pair<Point, Point>>& pairs,
+      int32_t radius) const;
+
   const Vision& getVision(const Entity& entity) const;
 
+  // The vision of a trainer's team: the trainer and each Pokemon whose
+  // trainer it is, as of when the Pokemon was added to the board.
+  bool canSee(const TeamVision& team, Point point) const;
+  int32_t visibilityAt(const TeamVision& team, Point point) const;
+  const TeamVision& getTeamVision(const Entity& trainer) const;
+
+  // The full-circle vision from any point, for lights and area effects. These
+  // visions are cached in a small LRU keyed by point and radius, and tile
+  // changes update them like entities' visions. A result stays valid until
+  // it's evicted, which takes many calls for other keys.
+  const Vision& getVisionAt(Point p, int32_t radius) const;
+
+  // The entities that can see the point, in no particular order.
+  std::vector<Entity*> getObservers(Point p) const;
+
+  // Recomputes the dirty visions in the cache, spreading the work over the
+  // pool: those of entities whose vision was asked for, and point visions.
+  // Other visions stay lazy, as do any left when the deadline passes. No other
+  // calls may be made on the board while this one runs.
+  void refreshVisions(WorkerPool& pool, time_ns_t deadline) const;
+
+  // Lighting. A light reaches the cells in its full-circle vision, with a
+  // level that falls off linearly out to its radius. A cell's light level is
+  // the ambient level plus the light it gets from each source, capped at full
+  // daylight, which is the default ambient level. Entities can't see cells
+  // with no light, and they see a lit cell no better than its light level.
+  //
+  // Changes to lights and tiles only mark lights dirty. updateLights applies
+  // them, and must be called before the light map is read again.
+
+  int32_t addLight(Point p, int32_t radius);
+  void moveLight(int32_t light, Point p);
+  void removeLight(int32_t light);
+  void setAmbientLight(int32_t level);
+  void updateLights();
+  int32_t lightAt(Point p) const;
+
+  // Merges the cells that an entity can see in a vision into its knowledge.
+  void updateKnowledge(const Vision& vision, Knowledge& knowledge) const;
+
 private:
-  void dirtyVision(const Entity& entity, const Point* target);
+  struct Light {
+    Point pos;
+    Vision* vision = nullptr;
+    bool applied = false;
+  };
 
-  const FOV m_fov;
-  size_t m_entityIndex = {};
+  Vision* takeVision(int32_t radius) const;
+  void releaseVision(Vision* vision) const;
+  Vision* findVision(const Entity& entity) const;
+  Vision& allocateVision(const Entity& entity) const;
+  const Vision& openVision(int32_t radius) const;
+  void computeVision(Point pos, Vision& vision) const;
+  void castVision(Point pos, Vision& vision) const;
+  void computeVisionArc(Point pos, Vision& vision) const;
+  int32_t unlitVisibilityBetween(Point from, Point to, int32_t radius) const;
+  void dirtyVision(Vision& vision, const Point* target);
+  void moveVision(const Entity& entity, Point from);
+  bool repairVision(Vision& vision, const std::vector<Point>& changed) const;
+  int32_t lit(Point p, int32_t visibility) const;
+  void dirtyLight(int32_t light);
+  void applyLight(const Vision& vision, int32_t sign);
+  void joinTeam(TeamVision& team, const Entity& entity) const;
+  void leaveTeam(const Entity& entity);
+  void mergeTeamMember(TeamVision& team, size_t i, const Vision& vision) const;
+  void computeVisionTrie(Point pos, Vision& vision) const;
+  void computeVisionBitboard(Point pos, Vision& vision) const;
+  void computeVisionShadowcast(Point pos, Vision& vision) const;
+
+  template <typename Fn>
+  void forEachEntityInRange(Point p, Fn fn) const;
+  void placeEntity(Entity& entity);
+  size_t activeRow();
+  bool startRound();
+  void scheduleTurn(uint32_t row, uint64_t round);
+  void sortEntityTable();
+  void indexEntity(Entity& entity, bool insert);
+  void countOpaqueTiles();
+  void updateFreeSteps(Point p);
+  void countFreeSteps();
+
+  const FOV& m_fov;
+  FOVEngine m_fovEngine = FOVEngine::Trie;
   Matrix<const Tile*> m_map;
-  std::vector<Entity*> m_entities;
-  HashMap<Point, OwnedEntity> m_entityAtPos;
-  mutable HashMap<const Entity*, std::unique_ptr<Vision>> m_vision;
+  BitMatrix m_blocked;
+  BitMatrix m_obscure;
+  Matrix<int32_t> m_opaqueByBlock;
+  EntityMap m_entities;
+
+  // The entity table, each entity's row in it by slot, and the number of
+  // moves, additions and removals since we last sorted it.
+  EntityTable m_table;
+  std::vector<uint32_t> m_rows;
+  size_t m_tableChanges = 0;
+
+  // Scheduled turns. Entities take turns in row order within a round: we
+  // keep the rows due this round, from m_turnIndex on; the rows due in each
+  // of the next few rounds, bucketed by round; and a min-heap of (round, row)
+  // turns after that. A turn whose row has no entity is dropped.
+  std::vector<uint32_t> m_turns;
+  size_t m_turnIndex = 0;
+  std::vector<std::vector<uint32_t>> m_wheel;
+  std::vector<std::pair<uint64_t, uint32_t>> m_laterTurns;
+  uint64_t m_round = 0;
+
+  // The entity at each cell, by handle, which we resolve through m_entities.
+  Matrix<EntityId> m_entityAt;
+  Matrix<uint8_t> m_freeSteps;
+  HashMap<Point, std::vector<Entity*>> m_entitiesByBlock;
+
+  // Each entity's vision, if it has one, indexed by the entity's slot.
+  mutable std::vector<Vision*> m_vision;
+
+  // Storage for visions: one slab of cells for each radius, and a pool of
+  // visions that we reuse as entities come and go.
+  mutable std::deque<VisionSlab> m_visionSlabs;
+  mutable std::deque<Vision> m_visionPool;
+  mutable std::vector<Vision*> m_freeVisions;
+
+  // Visions cast from points, most recently used first, and an index on them
+  // by point and radius.
+  using PointVision = std::pair<Point, Vision*>;
+  mutable std::list<PointVision> m_pointVisions;
+  mutable HashMap<std::pair<Point, int32_t>,
+                  std::list<PointVision>::iterator> m_pointVisionIndex;
+
+  // Lights, with the contributions of those whose visions have been computed
+  // summed up in m_light. Each light's contribution is the one that its
+  // vision's cells give, so we can take it away before we recompute it.
+  int32_t m_ambientLight;
+  Matrix<int32_t> m_light;
+  std::vector<Light> m_lights;
+  std::vector<int32_t> m_dirtyLights;
+  std::vector<int32_t> m_freeLights;
+
+  // Team visions, built on first use, keyed by trainer.
+  mutable HashMap<EntityId, std::unique_ptr<TeamVision>> m_teams;
 
   DISALLOW_COPY_AND_ASSIGN(Board);
 };
 
+template <typename T, typename... Args>
+T& Board::addEntity(Args&&... args) {
+  auto& result = m_entities.add<T>(std::forward<Args>(args)...);
+  placeEntity(result);
+  return result;
+}
+
 //////////////////////////////////////////////////////////////////////////////
 
 struct IdleAction {};
@@ -101,14 +372,35 @@ using MaybeAction = std::optional<Action>;
 
 using RNG = std::mt19937;
 
+// Each entity plans with its own small RNG, seeded from the state's one. We
+// use a 32-bit LCG: it takes four bytes per entity, and its full range keeps
+// std::uniform_int_distribution, which uses its high bits, on a fast path.
+using EntityRNG =
+    std::linear_congruential_engine<uint32_t, 1664525, 1013904223, 0>;
+
 struct State {
   State();
 
   RNG rng;
   Board board;
-  Entity* player;
+  EntityId player;
   MaybeAction input;
 
+  // What each trainer on the board remembers of it, by the trainer's handle.
+  HashMap<EntityId, std::unique_ptr<Knowledge>> knowledge;
+
+  // The number of turns in the rest of this round that the last update ran
+  // out of time for. They're taken on the next update, before anything else
+  // happens. Turns in later rounds aren't counted.
+  size_t deferred_this_round = 0;
+
+  // Planning: the workers, each entity's RNG by slot, and the batch of plans
+  // that we're acting out, from next_plan on.
+  WorkerPool pool;
+  std::vector<std::pair<EntityId, EntityRNG>> streams;
+  std::vector<std::pair<EntityId, Action>> plans;
+  size_t next_plan = 0;
+
   DISALLOW_COPY_AND_ASSIGN(State);
 };
 
@@ -4,45 +4,229 @@
 // Tran-Thong symmetric line-of-sight calculation.
 
 std::vector<Point> LOS(const Point& a, const Point& b) {
-  auto const x_diff = std::abs(a.x - b.x);
-  auto const y_diff = std::abs(a.y - b.y);
-  auto const x_sign = b.x < a.x ? -1 : 1;
-  auto const y_sign = b.y < a.y ? -1 : 1;
-
-  auto const size = static_cast<size_t>(std::max(x_diff, y_diff) + 1);
+  auto const size = static_cast<size_t>(
+      std::max(std::abs(a.x - b.x), std::abs(a.y - b.y)) + 1);
   auto result = std::vector<Point>{};
   result.reserve(size);
-  result.push_back(a);
-
-  auto test = 0;
-  auto current = a;
-
-  if (x_diff >= y_diff) {
-    test = (x_diff + test) / 2;
-    for (auto i = 0; i < x_diff; i++) {
-      current.x += x_sign;
-      test -= y_diff;
-      if (test < 0) {
-        current.y += y_sign;
-        test += x_diff;
-      }
-      result.push_back(current);
-    }
-  } else {
-    test = (y_diff + test) / 2;
-    for (auto i = 0; i < y_diff; i++) {
-      current.y += y_sign;
-      test -= x_diff;
-      if (test < 0) {
-        current.x += x_sign;
-        test += y_diff;
-      }
-      result.push_back(current);
-    }
+
+  for (LOSWalker los(a, b); !los.done(); los.next()) {
+    result.push_back(los.point());
   }
 
   assert(result.size() == size);
   return result;
 };
 
+LOSTable::LOSTable(int32_t radius) : m_radius(radius) {
+  auto const side = 2 * radius + 1;
+  m_offsets.reserve(side * side + 1);
+  m_offsets.push_back(0);
+  for (auto y = -radius; y <= radius; y++) {
+    for (auto x = -radius; x <= radius; x++) {
+      auto const target = Point{x, y};
+      for (LOSWalker los(Point::origin(), target); !los.done(); los.next()) {
+        m_points.push_back(los.point());
+      }
+      m_offsets.push_back(static_cast<int32_t>(m_points.size()));
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Bit lanes for the precomputed FOV trie.
+
+FOVLanes::FOVLanes(const FOV& fov) {
+  auto const nodes = fov.nodes;
+  auto const size = fov.size;
+
+  // Assign lanes to leaves in DFS order, then OR each node's lanes into its
+  // parent's. BFS order puts parents first, so we can walk it backwards.
+  std::vector<int32_t> lane(size, -1);
+  auto lanes = 0;
+  std::vector<int32_t> stack{0};
+  while (!stack.empty()) {
+    auto const& node = nodes[stack.back()];
+    if (node.children == 0) lane[stack.back()] = lanes++;
+    stack.pop_back();
+    for (auto i = node.children - 1; i >= 0; i--) {
+      stack.push_back(node.child + i);
+    }
+  }
+
+  words = (lanes + 63) / 64;
+  std::vector<uint64_t> lanes_of(size * words, 0);
+  for (auto i = static_cast<int32_t>(size) - 1; i >= 0; i--) {
+    auto const mine = &lanes_of[i * words];
+    if (lane[i] >= 0) mine[lane[i] / 64] |= uint64_t{1} << (lane[i] % 64);
+    if (i == 0) continue;
+    auto const theirs = &lanes_of[nodes[i].parent * words];
+    for (size_t j = 0; j < words; j++) theirs[j] |= mine[j];
+  }
+
+  auto const add = [&](size_t index, size_t node) {
+    for (size_t j = 0; j < words; j++) {
+      masks[index * words + j] |= lanes_of[node * words + j];
+    }
+  };
+  auto const alloc = [&]{
+    masks.resize(masks.size() + words, 0);
+    return masks.size() / words - 1;
+  };
+
+  // Nodes at one depth are contiguous in BFS order, and a cell's depth is its
+  // walking distance, so we can group each depth's nodes by cell.
+  for (size_t i = 0; i < size;) {
+    auto const depth = nodes[i].point.lenWalking();
+    auto const start = cells.size();
+    auto const diagonal = alloc();
+    auto const live = alloc();
+    for (; i < size && nodes[i].point.lenWalking() == depth; i++) {
+      auto const& node = nodes[i];
+      auto const cell = [&]{
+        for (auto j = start; j < cells.size(); j++) {
+          if (cells[j].point == node.point) return j;
+        }
+        cells.push_back({node.point, alloc()});
+        return cells.size() - 1;
+      }();
+      add(cells[cell].mask, i);
+      add(live, i);
+      if (node.parent < 0) continue;
+      auto const& prev = nodes[node.parent].point;
+      if (node.point.x != prev.x && node.point.y != prev.y) add(diagonal, i);
+    }
+    depths.push_back({start, cells.size(), diagonal, live});
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Dependency cones for point queries against the FOV trie.
+
+FOVCones::FOVCones(const FOV& fov) : radius(fov.radius) {
+  auto const side = 2 * radius + 1;
+  std::vector<int32_t> local(side * side, -1);
+  std::vector<int32_t> index(fov.size, -1);
+  std::vector<int32_t> queue;
+  std::vector<int32_t> cone;
+
+  auto const cellIndex = [&](Point p) {
+    return (p.x + radius) + side * (p.y + radius);
+  };
+
+  offsets.push_back(0);
+  for (auto target = 0; target < side * side; target++) {
+    // Gather the cone's cells, walking from the target toward the origin.
+    queue.clear();
+    cone.clear();
+    if (fov.cells[target] < fov.cells[target + 1]) {
+      local[target] = 0;
+      queue.push_back(target);
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+      auto const cell = queue[i];
+      for (auto j = fov.cells[cell]; j < fov.cells[cell + 1]; j++) {
+        auto const node = fov.cell_nodes[j];
+        cone.push_back(node);
+        auto const parent = fov.nodes[node].parent;
+        if (parent < 0) continue;
+        auto const prev = cellIndex(fov.nodes[parent].point);
+        if (local[prev] >= 0) continue;
+        local[prev] = static_cast<int32_t>(queue.size());
+        queue.push_back(prev);
+      }
+    }
+
+    std::sort(cone.begin(), cone.end());
+    for (size_t i = 0; i < cone.size(); i++) {
+      index[cone[i]] = static_cast<int32_t>(i);
+    }
+    for (auto const i : cone) {
+      auto const& node = fov.nodes[i];
+      auto const cell = local[cellIndex(node.point)];
+      if (node.parent < 0) {
+        nodes.push_back({node.point, -1, cell, -1, false});
+        continue;
+      }
+      auto const& prev = fov.nodes[node.parent].point;
+      auto const diagonal = node.point.x != prev.x && node.point.y != prev.y;
+      auto const parent_cell = local[cellIndex(prev)];
+      nodes.push_back({node.point, index[node.parent], cell,
+                       parent_cell, diagonal});
+    }
+
+    for (auto const i : cone) index[i] = -1;
+    for (auto const cell : queue) local[cell] = -1;
+    auto const count = static_cast<int32_t>(queue.size());
+    max_cells = std::max(max_cells, count);
+    cells.push_back(count);
+    offsets.push_back(static_cast<int32_t>(nodes.size()));
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////////
+// The subsets of the FOV trie that cones of vision depend on.
+
+namespace {
+
+constexpr Point kFacings[] = {
+  { 0, -1}, { 1, -1}, { 1,  0}, { 1,  1},
+  { 0,  1}, {-1,  1}, {-1,  0}, {-1, -1},
+};
+
+constexpr int32_t kArcs = 7;
+
+} // namespace
+
+FOVArcs::FOVArcs(const FOV& fov) {
+  auto const radius = fov.radius;
+  auto const side = 2 * radius + 1;
+  std::vector<uint8_t> marked(side * side, 0);
+  std::vector<int32_t> queue;
+
+  for (auto const facing : kFacings) {
+    for (auto i = 1; i <= kArcs; i++) {
+      auto& arc = arcs.emplace_back();
+      queue.clear();
+      for (auto y = -radius; y <= radius; y++) {
+        for (auto x = -radius; x <= radius; x++) {
+          auto const p = Point{x, y};
+          if (!inArc(p, facing, 45 * i)) {
+            arc.outside.push_back(p);
+            continue;
+          }
+          auto const cell = fov.cellIndex(p);
+          if (cell < 0) continue;
+          marked[cell] = 1;
+          queue.push_back(cell);
+        }
+      }
+
+      // Close the set of cells over their nodes' parents' cells.
+      for (size_t j = 0; j < queue.size(); j++) {
+        auto const cell = queue[j];
+        for (auto k = fov.cells[cell]; k < fov.cells[cell + 1]; k++) {
+          auto const node = fov.cell_nodes[k];
+          arc.nodes.push_back(node);
+          auto const parent = fov.nodes[node].parent;
+          if (parent < 0) continue;
+          auto const& prev = fov.nodes[parent].point;
+          auto const prev_cell = fov.cellIndex(prev);
+          if (marked[prev_cell]) continue;
+          marked[prev_cell] = 1;
+          queue.push_back(prev_cell);
+          arc.hidden.push_back(prev);
+        }
+      }
+
+      std::sort(arc.nodes.begin(), arc.nodes.end());
+      for (auto const cell : queue) marked[cell] = 0;
+    }
+  }
+}
+
+const FOVArcs::Arc& FOVArcs::get(Point facing, int32_t arc) const {
+  assert(arc % 45 == 0 && 0 < arc && arc < 360);
+  auto const it = std::find(std::begin(kFacings), std::end(kFacings), facing);
+  assert(it != std::end(kFacings));
+  return arcs[(it - std::begin(kFacings)) * kArcs + arc / 45 - 1];
+}
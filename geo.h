@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cmath>
 #include <cstdint>
 #include <vector>
 
@@ -11,17 +12,21 @@
 struct Point {
   constexpr static Point origin() { return {0, 0}; }
 
-  Point& operator+=(const Point& o) { *this = *this + o; return *this; }
-  Point& operator-=(const Point& o) { *this = *this - o; return *this; }
+  constexpr Point& operator+=(const Point& o) { return *this = *this + o; }
+  constexpr Point& operator-=(const Point& o) { return *this = *this - o; }
 
-  Point operator+(const Point& o) const { return {x + o.x, y + o.y}; }
-  Point operator-(const Point& o) const { return {x - o.x, y - o.y}; }
+  constexpr Point operator+(const Point& o) const { return {x + o.x, y + o.y}; }
+  constexpr Point operator-(const Point& o) const { return {x - o.x, y - o.y}; }
 
-  bool operator==(const Point& o) const { return x == o.x && y == o.y; }
-  bool operator!=(const Point& o) const { return x != o.x || y != o.y; }
+  constexpr bool operator==(const Point& o) const {
+    return x == o.x && y == o.y;
+  }
+  constexpr bool operator!=(const Point& o) const {
+    return x != o.x || y != o.y;
+  }
 
   double lenL2() const { return std::sqrt(lenL2Squared()); }
-  int32_t lenL2Squared() const { return x * x + y * y; }
+  constexpr int32_t lenL2Squared() const { return x * x + y * y; }
 
   int32_t lenNethack() const {
     auto const ax = std::abs(x);
@@ -68,66 +73,497 @@ struct Matrix {
     std::fill(m_data.begin(), m_data.end(), v);
   }
 
+  // The cells in row-major order, for loops over whole rows.
+  const Value* data() const { return m_data.data(); }
+
 private:
   Point m_size = {};
   Value m_init = {};
   std::vector<Value> m_data;
 };
 
+// A matrix of bits packed into 64-bit words, one run of words per row.
+
+struct BitMatrix {
+  BitMatrix() {}
+
+  BitMatrix(Point size, bool init)
+    : m_size(size), m_init(init), m_stride((size.x + 63) / 64),
+      m_data(m_stride * size.y, init ? ~uint64_t{0} : 0) {}
+
+  Point size() const { return m_size; }
+
+  bool get(Point p) const {
+    if (!contains(p)) return m_init;
+    return (m_data[p.x / 64 + m_stride * p.y] >> (p.x % 64)) & 1;
+  }
+
+  void set(Point p, bool v) {
+    if (!contains(p)) return;
+    auto& word = m_data[p.x / 64 + m_stride * p.y];
+    auto const bit = uint64_t{1} << (p.x % 64);
+    word = v ? (word | bit) : (word & ~bit);
+  }
+
+  // Returns the n <= 64 bits that start at p and run along its row, with the
+  // bit at p in the lowest position. Bits outside the matrix are m_init.
+  uint64_t getRow(Point p, int32_t n) const {
+    auto const bits = [](int32_t k) {
+      return k < 64 ? (uint64_t{1} << k) - 1 : ~uint64_t{0};
+    };
+    auto const init = m_init ? bits(n) : 0;
+    auto const lo = std::max(p.x, 0);
+    auto const hi = std::min(p.x + n, m_size.x);
+    if (p.y < 0 || p.y >= m_size.y || lo >= hi) return init;
+
+    auto const row = &m_data[m_stride * p.y];
+    auto const word = lo / 64;
+    auto const shift = lo % 64;
+    auto result = row[word] >> shift;
+    if (shift && word + 1 < m_stride) result |= row[word + 1] << (64 - shift);
+    auto const inside = bits(hi - lo) << (lo - p.x);
+    return ((result << (lo - p.x)) & inside) | (init & ~inside);
+  }
+
+  bool contains(Point p) const {
+    return 0 <= p.x && p.x < m_size.x && 0 <= p.y && p.y < m_size.y;
+  }
+
+  void fill(bool v) {
+    std::fill(m_data.begin(), m_data.end(), v ? ~uint64_t{0} : 0);
+  }
+
+private:
+  Point m_size = {};
+  bool m_init = {};
+  int32_t m_stride = {};
+  std::vector<uint64_t> m_data;
+};
+
 //////////////////////////////////////////////////////////////////////////////
 
+// Tran-Thong line stepping that doesn't allocate. The walker visits the same
+// points as LOS(a, b), starting at a and ending at b:
+//
+//   for (LOSWalker los(a, b); !los.done(); los.next()) visit(los.point());
+
+struct LOSWalker {
+  constexpr LOSWalker(Point a, Point b)
+    : m_point(a), m_left(std::max(abs(b.x - a.x), abs(b.y - a.y))),
+      m_x_major(abs(b.x - a.x) >= abs(b.y - a.y)),
+      m_major(m_left), m_minor(std::min(abs(b.x - a.x), abs(b.y - a.y))),
+      m_test(m_major / 2), m_sign{b.x < a.x ? -1 : 1, b.y < a.y ? -1 : 1} {}
+
+  constexpr bool done() const { return m_left < 0; }
+  constexpr Point point() const { return m_point; }
+
+  constexpr void next() {
+    if (m_left-- == 0) return;
+    m_test -= m_minor;
+    auto const step = m_test < 0;
+    if (step) m_test += m_major;
+    m_point.x += (m_x_major || step) ? m_sign.x : 0;
+    m_point.y += (!m_x_major || step) ? m_sign.y : 0;
+  }
+
+private:
+  static constexpr int32_t abs(int32_t x) { return x < 0 ? -x : x; }
+
+  Point m_point;
+  int32_t m_left;
+  bool m_x_major;
+  int32_t m_major;
+  int32_t m_minor;
+  int32_t m_test;
+  Point m_sign;
+};
+
 std::vector<Point> LOS(const Point& a, const Point& b);
 
+// Every line from the origin to an offset within the radius, precomputed and
+// packed into one array, so tracing a line is a table lookup.
+
+struct LOSTable {
+  explicit LOSTable(int32_t radius);
+
+  struct Line {
+    const Point* begin() const { return points; }
+    const Point* end() const { return points + count; }
+
+    const Point* points;
+    int32_t count;
+  };
+
+  int32_t radius() const { return m_radius; }
+
+  bool contains(Point delta) const {
+    return std::max(std::abs(delta.x), std::abs(delta.y)) <= m_radius;
+  }
+
+  // The points of LOS(origin, delta), which must be within the radius.
+  Line line(Point delta) const {
+    assert(contains(delta));
+    auto const side = 2 * m_radius + 1;
+    auto const index = (delta.x + m_radius) + side * (delta.y + m_radius);
+    auto const start = m_offsets[index];
+    return {m_points.data() + start, m_offsets[index + 1] - start};
+  }
+
+private:
+  int32_t m_radius;
+  std::vector<int32_t> m_offsets;
+  std::vector<Point> m_points;
+};
+
+// The FOV trie is stored as a flat array of nodes in BFS order. Each node's
+// children are contiguous, so a walk is a linear scan over the array.
+
 struct FOVNode {
-  const Point point = {};
-  const FOVNode* parent = {};
-  std::vector<std::unique_ptr<FOVNode>> children;
+  Point point;
+  int32_t parent;
+  int32_t child;
+  int32_t children;
 };
 
+// A view of an immutable trie. Use FOVTrie<radius>::kFOV to get one.
+//
+// Besides the nodes, we index the nodes at each cell: cell_nodes lists them,
+// ordered by cell, and the ones at cell i are [cells[i], cells[i + 1]).
+// subtrees[i] is the total size of the subtrees rooted at those nodes.
+
 struct FOV {
-  FOV(int32_t r) : radius(r) {
-    root = std::make_unique<FOVNode>();
-    for (auto i = 0; i <= radius; i++) {
-      for (auto j = 0; j < 8; j++) {
-        auto const [xa, ya] = (j & 1) ? Point{radius, i} : Point{i, radius};
-        auto const xb = xa * ((j & 2) ? 1 : -1);
-        auto const yb = ya * ((j & 4) ? 1 : -1);
-        trieUpdate(*root, LOS(Point::origin(), {xb, yb}), 0);
+  constexpr FOV(int32_t radius_, const FOVNode* nodes_, size_t size_,
+                const int32_t* cells_, const int32_t* cell_nodes_,
+                const int32_t* subtrees_)
+    : radius(radius_), nodes(nodes_), size(size_),
+      cells(cells_), cell_nodes(cell_nodes_), subtrees(subtrees_) {}
+
+  // The index of the cell at p, relative to the origin, or -1 if the trie
+  // has no nodes there.
+  int32_t cellIndex(Point p) const {
+    if (std::max(std::abs(p.x), std::abs(p.y)) > radius) return -1;
+    auto const side = 2 * radius + 1;
+    auto const result = (p.x + radius) + side * (p.y + radius);
+    return cells[result] < cells[result + 1] ? result : -1;
+  }
+
+  // Calls blocked(point, parent) for each node reachable from the root and
+  // skips the subtree of every node for which it returns true. Nodes at one
+  // depth are all visited before any node at the next depth, so a walk that
+  // stops at some depth only needs the first limit nodes.
+  //
+  // We walk a frontier of runs of nodes: the children of a node are a run,
+  // and the children of consecutive open nodes are one run, so a walk only
+  // touches the nodes that it visits. The frontier is scratch space per thread.
+  template <typename Fn>
+  void fieldOfVision(Fn blocked, size_t limit) const {
+    thread_local std::vector<std::pair<int32_t, int32_t>> scratch;
+    auto& runs = scratch;
+    auto const end = static_cast<int32_t>(limit);
+    runs.clear();
+    runs.push_back({0, std::min(1, end)});
+    for (size_t r = 0; r < runs.size(); r++) {
+      for (auto i = runs[r].first; i < runs[r].second; i++) {
+        auto const& node = nodes[i];
+        auto const parent = node.parent;
+        auto const prev = parent >= 0 ? &nodes[parent].point : nullptr;
+        if (blocked(node.point, prev)) continue;
+        auto const lo = node.child;
+        auto const hi = std::min(lo + node.children, end);
+        if (lo >= hi) continue;
+        if (runs.back().second == lo) {
+          runs.back().second = hi;
+        } else {
+          runs.push_back({lo, hi});
+        }
       }
     }
   }
 
-  template <typename Fn>
-  void fieldOfVision(Fn blocked) const {
-    cache.clear();
-    cache.push_back(root.get());
-    for (size_t i = 0; i < cache.size(); i++) {
-      auto const node = cache[i];
-      auto const prev = node->parent ? &node->parent->point : nullptr;
-      if (blocked(node->point, prev)) continue;
-      for (const auto& x : node->children) cache.push_back(x.get());
+  const int32_t radius;
+  const FOVNode* const nodes;
+  const size_t size;
+  const int32_t* const cells;
+  const int32_t* const cell_nodes;
+  const int32_t* const subtrees;
+};
+
+// The trie is the union of the LOS rays from the origin to each point on the
+// edge of the radius, cut off past the radius. We build it at compile time,
+// first as a linked trie with room for every ray, then flattened in BFS order.
+
+template <int32_t Radius>
+struct FOVTrieBuilder {
+  struct Node { Point point; int32_t first; int32_t last; int32_t next; };
+  Node nodes[8 * (Radius + 1) * (Radius + 1) + 1];
+  size_t size;
+};
+
+template <int32_t Radius>
+constexpr FOVTrieBuilder<Radius> buildFOVTrie() {
+  FOVTrieBuilder<Radius> trie{};
+  trie.nodes[0] = {Point::origin(), -1, -1, -1};
+  trie.size = 1;
+
+  auto const limit = (2 * Radius - 1) * (2 * Radius - 1);
+
+  for (auto i = 0; i <= Radius; i++) {
+    for (auto j = 0; j < 8; j++) {
+      auto const xa = (j & 1) ? Radius : i;
+      auto const ya = (j & 1) ? i : Radius;
+      auto const xb = xa * ((j & 2) ? 1 : -1);
+      auto const yb = ya * ((j & 4) ? 1 : -1);
+
+      // Walk the LOS to the perimeter, inserting each point as we go.
+      auto los = LOSWalker(Point::origin(), {xb, yb});
+      auto node = 0;
+
+      for (los.next(); !los.done(); los.next()) {
+        if (4 * trie.nodes[node].point.lenL2Squared() > limit) break;
+        auto const current = los.point();
+
+        auto child = trie.nodes[node].first;
+        while (child >= 0 && trie.nodes[child].point != current) {
+          child = trie.nodes[child].next;
+        }
+        if (child < 0) {
+          child = static_cast<int32_t>(trie.size++);
+          trie.nodes[child] = {current, -1, -1, -1};
+          auto& parent = trie.nodes[node];
+          if (parent.last >= 0) trie.nodes[parent.last].next = child;
+          if (parent.first < 0) parent.first = child;
+          parent.last = child;
+        }
+        node = child;
+      }
     }
   }
+  return trie;
+}
 
-private:
-  void trieUpdate(FOVNode& node, const std::vector<Point>& line, size_t i) {
-    assert(line[i] == node.point);
-    if (node.point.lenL2() > radius - 0.5) return;
-    if (!(i + 1 < line.size())) return;
+template <int32_t Radius, size_t Size>
+constexpr std::array<FOVNode, Size> flattenFOVTrie(
+    const FOVTrieBuilder<Radius>& trie) {
+  std::array<FOVNode, Size> result{};
+  std::array<int32_t, Size> order{};
+  result[0] = {Point::origin(), -1, 0, 0};
+  auto size = 1;
+  for (auto i = 0; i < size; i++) {
+    result[i].child = size;
+    for (auto child = trie.nodes[order[i]].first; child >= 0;
+         child = trie.nodes[child].next) {
+      order[size] = child;
+      result[size++] = {trie.nodes[child].point, i, 0, 0};
+      result[i].children++;
+    }
+  }
+  return result;
+}
+
+template <int32_t Radius, size_t Size>
+struct FOVCellIndex {
+  static constexpr int32_t kSide = 2 * Radius + 1;
+  std::array<int32_t, kSide * kSide + 1> cells;
+  std::array<int32_t, Size> nodes;
+  std::array<int32_t, kSide * kSide> subtrees;
+};
 
-    auto const next = line[i + 1];
-    auto& child = [&]() -> FOVNode& {
-      for (auto& x : node.children) if (x->point == next) return *x;
-      node.children.emplace_back(new FOVNode{next, &node, {}});
-      return *node.children.back();
-    }();
-    assert(next == child.point);
-    trieUpdate(child, line, i + 1);
+template <int32_t Radius, size_t Size>
+constexpr FOVCellIndex<Radius, Size> indexFOVTrie(
+    const std::array<FOVNode, Size>& nodes) {
+  using Index = FOVCellIndex<Radius, Size>;
+  auto const cell = [](Point p) {
+    return (p.x + Radius) + Index::kSide * (p.y + Radius);
+  };
+  Index result{};
+  for (auto const& node : nodes) result.cells[cell(node.point) + 1]++;
+  for (size_t i = 1; i < result.cells.size(); i++) {
+    result.cells[i] += result.cells[i - 1];
   }
+  auto next = result.cells;
+  for (size_t i = 0; i < Size; i++) {
+    result.nodes[next[cell(nodes[i].point)]++] = static_cast<int32_t>(i);
+  }
+  std::array<int32_t, Size> subtree{};
+  for (auto i = Size; i-- > 0;) {
+    auto const& node = nodes[i];
+    subtree[i] += 1;
+    if (node.parent >= 0) subtree[node.parent] += subtree[i];
+    result.subtrees[cell(node.point)] += subtree[i];
+  }
+  return result;
+}
 
-  const int32_t radius;
-  std::unique_ptr<FOVNode> root;
-  mutable std::vector<const FOVNode*> cache;
+template <int32_t Radius>
+struct FOVTrie {
+  static constexpr auto kTrie = buildFOVTrie<Radius>();
+  static constexpr auto kNodes = flattenFOVTrie<Radius, kTrie.size>(kTrie);
+  static constexpr auto kIndex = indexFOVTrie<Radius>(kNodes);
+  static constexpr FOV kFOV{Radius, kNodes.data(), kNodes.size(),
+                            kIndex.cells.data(), kIndex.nodes.data(),
+                            kIndex.subtrees.data()};
+};
+
+// The same trie, transposed into bit lanes: each root-to-leaf ray is one bit
+// of a lane mask, so we can advance every ray by one step with a few word-wide
+// operations. Lanes through a cell at a given depth share that cell's mask.
+
+struct FOVLanes {
+  explicit FOVLanes(const FOV& fov);
+
+  struct Cell { Point point; size_t mask; };
+
+  struct Depth {
+    size_t cells_start;
+    size_t cells_limit;
+    size_t diagonal;
+    size_t live;
+  };
+
+  const uint64_t* mask(size_t i) const { return &masks[i * words]; }
+
+  size_t words = 0;
+  std::vector<Cell> cells;
+  std::vector<Depth> depths;
+  std::vector<uint64_t> masks;
 };
 
+// For each cell of the trie, the nodes that its value depends on: the nodes
+// at that cell and, recursively, every node at the cell of one of their
+// parents. Evaluating a cone's nodes in BFS order gives its cell the value
+// that a walk of the whole trie would. The cone's own cell is its cell 0.
+
+struct FOVCones {
+  explicit FOVCones(const FOV& fov);
+
+  struct Node {
+    Point point;
+    int32_t parent;
+    int32_t cell;
+    int32_t parent_cell;
+    bool diagonal;
+  };
+
+  struct Cone {
+    const Node* nodes;
+    int32_t size;
+    int32_t cells;
+  };
+
+  // The cone at p, relative to the origin. It's empty if the trie has no
+  // nodes at p. Parents are indices into the cone, and cells are local to it.
+  Cone cone(Point p) const {
+    if (std::max(std::abs(p.x), std::abs(p.y)) > radius) return {};
+    auto const side = 2 * radius + 1;
+    auto const index = (p.x + radius) + side * (p.y + radius);
+    auto const start = offsets[index];
+    return {&nodes[start], offsets[index + 1] - start, cells[index]};
+  }
+
+  int32_t radius = 0;
+  int32_t max_cells = 0;
+  std::vector<int32_t> offsets;
+  std::vector<int32_t> cells;
+  std::vector<Node> nodes;
+};
+
+// True if p is within half of an arc of the given degrees around facing. The
+// origin is in every arc, and a zero facing or a 360-degree arc sees all.
+
+inline bool inArc(Point p, Point facing, int32_t arc) {
+  if (arc >= 360 || p == Point::origin() || facing == Point::origin()) {
+    return true;
+  }
+  auto const dot = static_cast<double>(p.x * facing.x + p.y * facing.y);
+  auto const norm = p.lenL2() * facing.lenL2();
+  return dot >= norm * std::cos(arc * M_PI / 360) - 1e-9;
+}
+
+// For each of the eight facings and each arc that's a multiple of 45 degrees
+// under 360, the nodes that a walk must visit to get the visibility of every
+// cell in the arc: the nodes at those cells and, recursively, every node at
+// the cell of one of their parents. Walking them in BFS order gives each cell
+// in the arc the value that a walk of the whole trie would.
+//
+// The walk also reaches some cells outside of the arc; those are "hidden".
+// "outside" lists every cell within the radius that's outside of the arc.
+
+struct FOVArcs {
+  explicit FOVArcs(const FOV& fov);
+
+  struct Arc {
+    std::vector<int32_t> nodes;
+    std::vector<Point> hidden;
+    std::vector<Point> outside;
+  };
+
+  // facing must be a single step, and arc a multiple of 45 under 360.
+  const Arc& get(Point facing, int32_t arc) const;
+
+  std::vector<Arc> arcs;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Symmetric shadowcasting, as described by Albert Ford. We scan each quadrant
+// one row at a time, outward from the origin, and call visit(point, symmetric)
+// on each cell in range. Cells for which it returns true are walls.
+//
+// A cell is symmetric if the origin is also in view from that cell; callers
+// should reveal walls and symmetric cells. Since rows are scanned in order of
+// depth, a cell's neighbours one step closer to the origin come before it.
+
+template <typename Fn>
+void shadowcast(int32_t radius, Fn visit) {
+  struct Slope { int32_t num; int32_t den; };
+  struct Row { int32_t depth; Slope start; Slope end; };
+
+  auto const floorDiv = [](int32_t a, int32_t b) {
+    return a / b - (a % b != 0 && a < 0 ? 1 : 0);
+  };
+  auto const range = (2 * radius + 1) * (2 * radius + 1);
+
+  visit(Point::origin(), true);
+
+  std::vector<Row> rows;
+  for (auto quadrant = 0; quadrant < 4; quadrant++) {
+    auto const transform = [&](int32_t depth, int32_t col) -> Point {
+      switch (quadrant) {
+        case 0: return {col, -depth};
+        case 1: return {depth, col};
+        case 2: return {col, depth};
+        default: return {-depth, col};
+      }
+    };
+
+    rows.clear();
+    rows.push_back({1, {-1, 1}, {1, 1}});
+    for (size_t i = 0; i < rows.size(); i++) {
+      auto row = rows[i];
+      if (row.depth > radius) continue;
+      auto const& [sn, sd] = row.start;
+      auto const& [en, ed] = row.end;
+      auto const min = floorDiv(2 * row.depth * sn + sd, 2 * sd);
+      auto const max = -floorDiv(ed - 2 * row.depth * en, 2 * ed);
+
+      enum { None, Wall, Floor } prev = None;
+      for (auto col = min; col <= max; col++) {
+        auto const p = transform(row.depth, col);
+        auto const wall = [&]{
+          if (4 * p.lenL2Squared() > range) return false;
+          auto const symmetric = col * sd >= row.depth * sn &&
+                                 col * ed <= row.depth * en;
+          return visit(p, symmetric);
+        }();
+        auto const slope = Slope{2 * col - 1, 2 * row.depth};
+        if (prev == Wall && !wall) row.start = slope;
+        if (prev == Floor && wall) {
+          rows.push_back({row.depth + 1, row.start, slope});
+        }
+        prev = wall ? Wall : Floor;
+      }
+      if (prev == Floor) rows.push_back({row.depth + 1, row.start, row.end});
+    }
+  }
+}
+
 //////////////////////////////////////////////////////////////////////////////
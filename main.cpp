@@ -88,6 +88,8 @@ struct Terminal {
 
   void exit() { initTerminal(false); }
 
+  size_t deferredThisRound() const { return io.state.deferred_this_round; }
+
  private:
   Point getSize() const {
     struct winsize w;
@@ -258,6 +260,8 @@ int main() {
     std::ostringstream ss;
     ss << std::fixed << std::setprecision(2)
        << "CPU: " << stats.cpu << "%; FPS: " << stats.fps;
+    auto const deferred = terminal.deferredThisRound();
+    if (deferred > 0) ss << "; Deferred this round: " << deferred;
     terminal.tick(ss.str());
     timing.end();
   }
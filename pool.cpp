@@ -0,0 +1,66 @@
+#include "pool.h"
+
+//////////////////////////////////////////////////////////////////////////////
+
+WorkerPool::WorkerPool(size_t threads) : m_size(threads) {}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (auto& thread : m_threads) thread.join();
+}
+
+void WorkerPool::run(size_t count, const std::function<void(size_t)>& task) {
+  if (m_size == 0 || count <= 1) {
+    for (size_t i = 0; i < count; i++) task(i);
+    return;
+  }
+  start();
+
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_count = count;
+    m_next = 0;
+    m_busy = m_threads.size();
+    m_batch++;
+  }
+  m_wake.notify_all();
+  drain();
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [&]{ return m_busy == 0; });
+  m_task = nullptr;
+}
+
+void WorkerPool::start() {
+  if (!m_threads.empty()) return;
+  for (size_t i = 0; i < m_size; i++) {
+    m_threads.emplace_back([this]{ work(); });
+  }
+}
+
+void WorkerPool::work() {
+  auto batch = uint64_t{0};
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_wake.wait(lock, [&]{ return m_stop || m_batch != batch; });
+      if (m_stop) return;
+      batch = m_batch;
+    }
+    drain();
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (--m_busy == 0) m_done.notify_one();
+    }
+  }
+}
+
+void WorkerPool::drain() {
+  auto const& task = *m_task;
+  for (auto i = m_next++; i < m_count; i = m_next++) task(i);
+}
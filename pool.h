@@ -0,0 +1,51 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "base.h"
+
+//////////////////////////////////////////////////////////////////////////////
+
+// A fixed set of worker threads that run batches of independent tasks. The
+// thread that calls run() works on the batch, too, so a pool with no threads
+// runs every task inline. Only one thread may call run() at a time. Threads
+// are only started by the first batch with more than one task, so a pool that
+// never gets one costs nothing.
+
+struct WorkerPool {
+  explicit WorkerPool(size_t threads);
+  ~WorkerPool();
+
+  // Calls task(i) for each i in [0, count) and returns once all are done.
+  void run(size_t count, const std::function<void(size_t)>& task);
+
+  size_t threads() const { return m_size; }
+
+private:
+  void start();
+  void work();
+  void drain();
+
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  std::vector<std::thread> m_threads;
+  size_t m_size = 0;
+
+  // The current batch. Workers claim tasks by incrementing m_next.
+  const std::function<void(size_t)>* m_task = nullptr;
+  size_t m_count = 0;
+  std::atomic<size_t> m_next = 0;
+  size_t m_busy = 0;
+  uint64_t m_batch = 0;
+  bool m_stop = false;
+
+  DISALLOW_COPY_AND_ASSIGN(WorkerPool);
+};
+
+//////////////////////////////////////////////////////////////////////////////